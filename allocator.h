@@ -7,9 +7,16 @@
 
 #include <stdbool.h> // for bool
 #include <stddef.h>  // for size_t
+#include <stdio.h>   // for FILE
 
-// Alignment requirement for all blocks
+// Alignment requirement for all blocks: 8, or 16 (-DALIGNMENT=16) for
+// the x86-64 ABI, which promises 16 for anything malloc returns
+#ifndef ALIGNMENT
 #define ALIGNMENT 8
+#endif
+#if ALIGNMENT != 8 && ALIGNMENT != 16
+#error "ALIGNMENT must be 8 or 16"
+#endif
 
 // maximum size of block that must be accommodated
 #define MAX_REQUEST_SIZE (1 << 30)
@@ -47,6 +54,121 @@ void *myrealloc(void *ptr, size_t new_size);
 void myfree(void *ptr);
 
 
+/* Function: mycalloc
+ * ------------------
+ * Custom version of calloc: allocates count * size bytes that read as
+ * zeros, or returns NULL if the product overflows. The explicit
+ * allocator only clears what it has written before, so memory fresh
+ * from the OS (the untouched end of the heap, pages it handed back,
+ * or a block's own mapping) costs nothing until first used.
+ */
+void *mycalloc(size_t count, size_t size);
+
+
+/* Function: mymemalign
+ * --------------------
+ * Allocates size bytes at an address that is a multiple of align, which
+ * must be a power of two (NULL otherwise). The slack in front of the
+ * block goes back to the heap as a free block of its own. The block is
+ * freed and resized like any other; a realloc that moves it keeps only
+ * ALIGNMENT.
+ */
+void *mymemalign(size_t align, size_t size);
+
+
+/* Function: myusable_size
+ * -----------------------
+ * Returns the usable size of an allocated block, at least the size it
+ * was requested with (0 for NULL).
+ */
+size_t myusable_size(void *ptr);
+
+
+/* Functions: mymalloc_batch, myfree_batch
+ * ----------------------------------------
+ * Explicit allocator only. mymalloc_batch allocates up to n blocks of
+ * size bytes into out and returns how many it got: where it can, it
+ * carves them side by side out of one free block in a single pass.
+ * myfree_batch frees the n blocks in ptrs (NULLs are skipped), sorting
+ * ptrs by address first so that neighbouring blocks are coalesced as
+ * one; the order of ptrs is not kept. Blocks from either call may also
+ * be freed or resized one at a time, and vice versa.
+ */
+size_t mymalloc_batch(size_t size, size_t n, void **out);
+void myfree_batch(void **ptrs, size_t n);
+
+
+/* Functions: myarena_count, myarena_usage
+ * ---------------------------------------
+ * The explicit allocator splits the heap segment into arenas, each an
+ * independent heap on its own slice of the segment (one arena unless
+ * built thread-safe, where there is about one per CPU). myarena_count
+ * returns the number of arenas; myarena_usage fills in usage for arena
+ * index 0..count-1 and returns false for an invalid index.
+ */
+typedef struct {
+    size_t heap_size;    // bytes in the arena's slice of the segment
+    size_t bytes_used;   // payload bytes in allocated blocks
+    size_t bytes_free;   // bytes in free blocks, remaining tail included
+    size_t free_blocks;  // free blocks on the arena's lists
+    size_t tail_size;    // bytes never yet allocated at the end of the slice
+    size_t committed;    // bytes of the slice committed from the OS so far
+    int threads;         // threads currently assigned to the arena
+} ArenaUsage;
+
+int myarena_count(void);
+bool myarena_usage(int arena, ArenaUsage *usage);
+
+
+/* Functions: myheap_stats, myheap_dump_stats
+ * -------------------------------------------
+ * Statistics kept by the implicit and explicit allocators. Counters are
+ * plain per-thread increments, cheap enough to leave on; myheap_stats
+ * adds them up and walks the free blocks, so call it on demand only.
+ * Histograms are indexed by power-of-two class: class i counts sizes
+ * 2^i .. 2^(i+1) - 1, and the last class takes everything larger.
+ * myheap_dump_stats prints the same as a report to fp.
+ *
+ * live_bytes counts the usable size of every outstanding allocation, so
+ * it includes the padding each allocator rounds requests up to. In the
+ * thread-safe explicit build peak_bytes is only sampled by myheap_stats.
+ * The heap's untouched tail is neither in heap_bytes nor a free block.
+ */
+#define STATS_CLASSES 32
+
+typedef struct {
+    size_t live_bytes;     // usable bytes of outstanding allocations
+    size_t peak_bytes;     // highest live_bytes seen
+    size_t heap_bytes;     // bytes of the segment carved into blocks
+    size_t free_bytes;     // bytes in free blocks
+    size_t largest_free;   // size of the largest free block
+    double fragmentation;  // 1 - largest_free / free_bytes (0 if none free)
+    size_t mallocs;        // successful calls, realloc counted on its own
+    size_t reallocs;
+    size_t frees;
+    size_t free_blocks[STATS_CLASSES]; // free blocks by block size
+    size_t allocs[STATS_CLASSES];      // mallocs by requested size
+    size_t searches[STATS_CLASSES];    // free block searches by size sought
+    size_t searched[STATS_CLASSES];    // blocks examined by those searches
+} HeapStats;
+
+bool myheap_stats(HeapStats *stats);
+void myheap_dump_stats(FILE *fp);
+
+
+/* Function: myheap_dump_profile
+ * -----------------------------
+ * Heap profile of the explicit allocator built with -DPROFILE_RATE=n,
+ * which samples about one allocation per n bytes requested and keeps the
+ * caller's stack for each. Prints the sampled call sites to fp, most
+ * live bytes first: with pprof set in the legacy heap profile format
+ * that `pprof` reads, otherwise as a report of estimated live and
+ * allocated bytes per site with the stacks symbolized. Returns false,
+ * printing nothing, in a build without the profile.
+ */
+bool myheap_dump_profile(FILE *fp, bool pprof);
+
+
 /* Function: validate_heap
  * -----------------------
  * This is the hook for your heap consistency checker. Returns true
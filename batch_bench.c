@@ -0,0 +1,120 @@
+/* File: batch_bench.c
+ * -------------------
+ * Benchmark for mymalloc_batch/myfree_batch against the same work done
+ * one call at a time. Each round allocates n blocks of one size, writes
+ * to each, and frees them all again, on a fresh heap and on one left
+ * fragmented by a random mix of live and freed blocks. Prints ns per
+ * object for both ways and the speedup of the batch calls.
+ *
+ * usage: batch_bench [-n blocks_per_round] [-r rounds]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "allocator.h"
+#include "segment.h"
+
+#define HEAP_SIZE (1L << 30)
+#define MAX_BATCH 4096
+#define NOISE_BLOCKS 20000 // blocks allocated to fragment the heap
+
+static size_t sizes[] = { 48, 320, 512, 2000, 8000 };
+static int batch = 32;
+static long rounds = 200000;
+static void *noise[NOISE_BLOCKS];
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// resets the heap, then for a fragmented heap allocates blocks of
+// random size and frees about half of them, leaving holes of all sizes
+static void prepare_heap(bool fragmented) {
+    myinit(heap_segment_start(), heap_segment_size());
+    if (!fragmented) {
+        return;
+    }
+    srand(1);
+    for (int i = 0; i < NOISE_BLOCKS; i++) {
+        noise[i] = mymalloc(rand() % 4000 + 1);
+    }
+    for (int i = 0; i < NOISE_BLOCKS; i++) {
+        if (rand() % 2) {
+            myfree(noise[i]);
+        }
+    }
+}
+
+// runs the rounds one call at a time (batched false) or through the
+// batch calls, and returns the ns spent per object
+static double run(size_t size, bool batched) {
+    void *blocks[MAX_BATCH];
+    double start = now();
+
+    for (long r = 0; r < rounds; r++) {
+        if (batched) {
+            if (mymalloc_batch(size, batch, blocks) != (size_t)batch) {
+                fprintf(stderr, "heap full\n");
+                exit(1);
+            }
+        } else {
+            for (int i = 0; i < batch; i++) {
+                blocks[i] = mymalloc(size);
+            }
+        }
+        for (int i = 0; i < batch; i++) {
+            *(char *)blocks[i] = 1; // touch the block like a real caller
+        }
+        if (batched) {
+            myfree_batch(blocks, batch);
+        } else {
+            for (int i = 0; i < batch; i++) {
+                myfree(blocks[i]);
+            }
+        }
+    }
+    return (now() - start) * 1e9 / ((double)rounds * batch);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:r:")) != -1) {
+        switch (opt) {
+            case 'n': batch = atoi(optarg); break;
+            case 'r': rounds = atol(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-n blocks_per_round] [-r rounds]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (batch < 1 || batch > MAX_BATCH || rounds < 1) {
+        fprintf(stderr, "bad arguments\n");
+        return 1;
+    }
+    if (!init_heap_segment(HEAP_SIZE)) {
+        fprintf(stderr, "heap initialization failed\n");
+        return 1;
+    }
+
+    printf("heap         size   single ns   batch ns   speedup\n");
+    for (int fragmented = 0; fragmented <= 1; fragmented++) {
+        for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+            prepare_heap(fragmented);
+            double single = run(sizes[i], false);
+            prepare_heap(fragmented);
+            double batched = run(sizes[i], true);
+            printf("%-10s %6zu %11.1f %10.1f %8.2fx\n", fragmented ? "fragmented" : "fresh",
+                   sizes[i], single, batched, single / batched);
+            if (!validate_heap()) {
+                fprintf(stderr, "heap invalid after %zu-byte rounds\n", sizes[i]);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,72 @@
+/* This file contains the bump allocator, the baseline the implicit and
+   explicit allocators are measured against. Each request is carved off
+   the end of the heap and never reused: free is a no-op and realloc
+   always moves. Fast, but utilization is as poor as it gets.
+ */
+
+#include "allocator.h"
+#include "segment.h"
+#include <string.h>
+
+#define HEADER_SIZE 8 // payload size, so realloc knows how much to copy
+#define COMMIT_CHUNK (1L << 20) // segment is committed this much at a time
+
+static char *segment_start;
+static size_t segment_size;
+static char *next_free; // first byte past the last block
+static char *committed; // segment committed up to here
+
+// rounds up sz to closest multiple of mult
+size_t roundup(size_t sz, size_t mult) {
+    return (sz + mult - 1) & ~(mult - 1);
+}
+
+bool myinit(void *heap_start, size_t heap_size) {
+    segment_start = heap_start;
+    segment_size = heap_size;
+    committed = segment_start;
+    next_free = segment_start + ALIGNMENT - HEADER_SIZE; // payloads land aligned
+    return true;
+}
+
+void *mymalloc(size_t requested_size) {
+    size_t total_size = roundup(requested_size + HEADER_SIZE, ALIGNMENT);
+    
+    if (requested_size == 0 || requested_size > MAX_REQUEST_SIZE ||
+        total_size > (size_t)(segment_start + segment_size - next_free)) {
+        return NULL;
+    }
+    if (next_free + total_size > committed) {
+        size_t grow = roundup(next_free + total_size - committed, COMMIT_CHUNK);
+        if (grow > (size_t)(segment_start + segment_size - committed)) {
+            grow = segment_start + segment_size - committed;
+        }
+        if (!heap_segment_commit(committed, grow)) {
+            return NULL;
+        }
+        committed += grow;
+    }
+    *(size_t *)next_free = requested_size;
+    void *block = next_free + HEADER_SIZE;
+    next_free += total_size;
+    return block;
+}
+
+void myfree(void *ptr) {
+}
+
+void *myrealloc(void *old_ptr, size_t new_size) {
+    if (new_size == 0) {
+        return NULL;
+    }
+    void *new_ptr = mymalloc(new_size);
+    if (old_ptr != NULL && new_ptr != NULL) {
+        size_t old_size = *((size_t *)old_ptr - 1);
+        memcpy(new_ptr, old_ptr, (old_size < new_size) ? old_size : new_size);
+    }
+    return new_ptr;
+}
+
+bool validate_heap() {
+    return next_free >= segment_start && next_free <= segment_start + segment_size;
+}
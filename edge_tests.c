@@ -0,0 +1,106 @@
+/* File: edge_tests.c
+ * ------------------
+ * Checks of corner cases the trace replays don't reach, run against one
+ * build of the explicit allocator each: edge_tests_explicit,
+ * edge_tests_explicit_compact and so on (`make check` runs them all).
+ * Each test runs on a freshly initialized heap and prints its name and
+ * whether it passed; the program exits with status 1 if any failed, and
+ * a hardened build aborts outright on the corruption it detects.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "allocator.h"
+#include "segment.h"
+
+#define HEAP_SIZE (64L << 20)
+#define SMALL_HEAP_SIZE (4L << 20) // for tests that fill the heap
+#define PAGE 4096
+#define PREFIX 16 // mapped blocks start this far into their mapping
+
+typedef bool (*Test)(void);
+
+// mapped blocks, whose sizes fill whole pages, must still report at
+// least what was asked for, whatever the header size; the requests end
+// a few bytes either side of a page boundary
+static bool mapped_usable_size() {
+    for (size_t pages = 256; pages < 320; pages += 7) {
+        for (size_t size = pages * PAGE - PREFIX - 12; size <= pages * PAGE - PREFIX + 12; size++) {
+            char *a = mymalloc(size);
+            char *b = mycalloc(1, size);
+            if (a == NULL || b == NULL || myusable_size(a) < size || myusable_size(b) < size) {
+                fprintf(stderr, "  %zu bytes: usable %zu, %zu\n", size,
+                        a ? myusable_size(a) : 0, b ? myusable_size(b) : 0);
+                return false;
+            }
+            memset(a, 1, size);
+            a = myrealloc(a, size + PAGE);
+            if (a == NULL || myusable_size(a) < size + PAGE) {
+                return false;
+            }
+            myfree(a);
+            myfree(b);
+        }
+    }
+    return true;
+}
+
+// a realloc that fails once the heap is full leaves the block as it was:
+// its contents kept, and freeing it (which checks a hardened build's
+// guard word) fine, even though the grow first merged the free block
+// on its right into it
+static bool failed_realloc() {
+    if (!myinit(heap_segment_start(), SMALL_HEAP_SIZE)) {
+        return false;
+    }
+    char *a = mymalloc(5000);
+    char *b = mymalloc(5000);
+    char *c = mymalloc(5000); // keeps b from merging with the end
+    if (a == NULL || b == NULL || c == NULL) {
+        return false;
+    }
+    memset(a, 'a', 5000);
+    myfree(b);
+    for (size_t size = 1 << 16; size > 5000; size /= 2) {
+        while (mymalloc(size) != NULL) {
+        }
+    }
+    if (myrealloc(a, 900000) != NULL) {
+        fprintf(stderr, "  heap not full\n");
+        return false;
+    }
+    for (int i = 0; i < 5000; i++) {
+        if (a[i] != 'a') {
+            return false;
+        }
+    }
+    myfree(a);
+    myfree(c);
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    static const struct {
+        const char *name;
+        Test run;
+    } tests[] = {
+        {"mapped_usable_size", mapped_usable_size},
+        {"failed_realloc", failed_realloc},
+    };
+    int failed = 0;
+
+    if (!init_heap_segment(HEAP_SIZE)) {
+        fprintf(stderr, "heap initialization failed\n");
+        return 1;
+    }
+    for (size_t i = 0; i < sizeof(tests) / sizeof(tests[0]); i++) {
+        if (!myinit(heap_segment_start(), heap_segment_size())) {
+            fprintf(stderr, "heap initialization failed\n");
+            return 1;
+        }
+        bool ok = tests[i].run() && validate_heap();
+        printf("%-24s %s\n", tests[i].name, ok ? "ok" : "FAILED");
+        failed += !ok;
+    }
+    return failed ? 1 : 0;
+}
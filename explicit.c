@@ -1,29 +1,234 @@
 /* This program contains the implementation of the explicit heap allocator,
    builds largely on the implicit free list allocator (see implicit.c).
    See readme file for specific features
+
+   Requests of up to SLAB_MAX_SIZE bytes are served from header-less slab
+   objects (see the slab section below the heap routines), and requests of
+   MMAP_THRESHOLD bytes or more get a mapping of their own.
+
+   Built with -DTHREAD_SAFE, the heap is guarded by a mutex and each thread
+   keeps a cache of small blocks in front of it (see the thread cache
+   section at the bottom of this file).
 */
 
+#define _GNU_SOURCE // for mremap
 #include "allocator.h"
 #include "debug_break.h"
+#include "segment.h"
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#ifdef HARDENED
+#include <sys/random.h>
+#include <time.h>
+#endif
+#ifdef THREAD_SAFE
+#include <pthread.h>
+#include <unistd.h>
+#endif
+#ifdef PROFILE_RATE
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <unistd.h>
+#endif
 
+// Compact headers (-DCOMPACT_HEADERS) are 4 bytes, and free blocks link
+// through 32-bit offsets from segment_start, so the minimum block shrinks
+// from 32 bytes to 16. The heap then uses at most the first 4 GiB of the
+// segment, and there are no spare header bits to name a thread cache
+#ifdef COMPACT_HEADERS
+#ifdef THREAD_SAFE
+#error "COMPACT_HEADERS has no room for the thread-safe build's owner bits"
+#endif
+#define HEADER_SIZE 4
+#define FOOTER_SIZE 4
+#define MAX_COMPACT_SEGMENT ((1UL << 32) - PAGE_SIZE) // offsets and sizes fit 32 bits
+#else
 #define HEADER_SIZE 8
-#define MIN_BLOCK_SIZE HEADER_SIZE + sizeof(ListPointers)
+#define FOOTER_SIZE 8
+#endif
+#define MIN_BLOCK_SIZE (HEADER_SIZE + sizeof(ListPointers) + FOOTER_SIZE)
+
+// -DCACHE_ALIGNED lays the heap out in whole cache lines, so objects that
+// different threads write to don't share one: block sizes are rounded to
+// CACHE_LINE and payloads start on a line, leaving only the next block's
+// header in a block's last line. Slab classes of a line or more are line
+// multiples and start on lines; smaller objects stay packed, in slabs
+// that only one thread allocates from (in the thread-safe build). A
+// small object is still only ALIGNMENT-aligned
+#define CACHE_LINE 64
+#ifdef CACHE_ALIGNED
+#define BLOCK_ALIGN CACHE_LINE // heap block sizes and payloads
+#else
+#define BLOCK_ALIGN ALIGNMENT
+#endif
+
+// Segregated fit keeps one free list per power-of-two size class and a
+// bitmap of the classes that are non-empty. Build with -DSEGREGATED_FIT=0
+// to fall back to a single first-fit list.
+#ifndef SEGREGATED_FIT
+#define SEGREGATED_FIT 1
+#endif
+
+#if SEGREGATED_FIT
+#define NUM_SIZE_CLASSES 48
+#define MAX_CLASS_PROBES 8 // blocks checked in the request's own class
+#else
+#define NUM_SIZE_CLASSES 1
+#define MAX_CLASS_PROBES ((size_t)-1)
+#endif
+#define MIN_CLASS_SHIFT 4 // class 0 holds blocks of 16-31 bytes
+
+// Each arena commits its slice of the segment a chunk at a time as end
+// advances. Pages of end the heap has written, and the inside of free
+// blocks of at least RELEASE_THRESHOLD bytes, are handed back to the OS
+// (see release_block); build with -DRELEASE_THRESHOLD=0 to keep them.
+// Past the zeroed mark the slice has never been written (or was handed
+// back), so mycalloc only clears what lies in front of it
+#define COMMIT_CHUNK (1L << 20)
+#ifndef RELEASE_THRESHOLD
+#define RELEASE_THRESHOLD (128L << 10)
+#endif
+#define PAGE_SIZE 4096
+
+// -DQUICK_MAX_SIZE=n defers coalescing for blocks of up to n bytes,
+// header included: heap_free parks them in quick lists by exact size for
+// the next request of that size, and they are only coalesced by a sweep
+// (see the quick list section below the heap routines)
+#ifndef QUICK_MAX_SIZE
+#define QUICK_MAX_SIZE 0
+#endif
+#define QUICK_BINS (QUICK_MAX_SIZE / BLOCK_ALIGN + 1)
+#define QUICK_MAP_WORDS ((QUICK_BINS + 63) / 64)
+#define QUICK_LIMIT 64 // blocks a quick list holds before the sweep
+
+// -DVALIDATE_RATE=n validates the heap after every n-th call (see
+// sample_validate at the bottom of this file)
+#ifndef VALIDATE_RATE
+#define VALIDATE_RATE 0
+#endif
+#if VALIDATE_RATE > 0
+#define SAMPLE_VALIDATE() sample_validate()
+#else
+#define SAMPLE_VALIDATE()
+#endif
+
+// -DPROFILE_RATE=n samples about one allocation per n bytes for the heap
+// profile (see the profile section at the bottom of this file). An
+// unsampled malloc costs a countdown, an unsampled free one filter load
+#ifndef PROFILE_RATE
+#define PROFILE_RATE 0
+#endif
+#if PROFILE_RATE > 0
+#define PROFILE_FILTER_BITS 16
+#define PROFILE_HASH(ptr, bits) (((uintptr_t)(ptr) >> 3) * 0x9E3779B97F4A7C15UL >> (64 - (bits)))
+#define PROFILE_ALLOC(ptr, size) \
+    ((bytes_until_sample -= (long)(size)) < 0 ? profile_alloc(ptr, size) : (void)0)
+#define PROFILE_FREE(ptr) \
+    (__atomic_load_n(&profile_filter[PROFILE_HASH(ptr, PROFILE_FILTER_BITS)], __ATOMIC_RELAXED) ? \
+     profile_free(ptr) : (void)0)
+#else
+#define PROFILE_ALLOC(ptr, size)
+#define PROFILE_FREE(ptr)
+#endif
+
+// Requests of at least MMAP_THRESHOLD bytes are mapped on their own (see
+// the mapped block section); build with -DMMAP_THRESHOLD=0 to turn it off
+#ifndef MMAP_THRESHOLD
+#define MMAP_THRESHOLD (1L << 20)
+#endif
+
+// Hardened builds (-DHARDENED) seal each header with a canary derived
+// from a per-heap secret, the header's address and its size, mangle free
+// list links with the secret, and put a guard word after each payload,
+// so a corrupted header, a smashed link, an overflow past the end of a
+// block or a double free aborts the program instead of spreading (see
+// the hardening section below the mapped blocks)
+#ifdef HARDENED
+#ifdef COMPACT_HEADERS
+#error "HARDENED needs the 8-byte header's top bits for its canary"
+#endif
+#define CANARY_SHIFT 48 // bits above the owner hold the canary
+#define REDZONE_SIZE 8 // guard word at the end of each payload
+#define SET_HEADER(p, val) (GET(p) = seal((Header *)(p), val))
+#define CHECK_LINK(a, h, prev, next) check_link(a, h, prev, next)
+#define CHECK_HEADER(h) check_header(h)
+#define CHECK_BLOCK(ptr, size) check_block(ptr, size)
+#define GUARD_VALUE(ptr) (heap_secret ^ (uintptr_t)(ptr)) // guard of a live block
+#define GUARD_BLOCK(ptr, size) (*(size_t *)((char *)(ptr) + (size)) = GUARD_VALUE(ptr))
+#define POISON_BLOCK(ptr, size) (*(size_t *)((char *)(ptr) + (size)) = ~GUARD_VALUE(ptr))
+#else
+#define REDZONE_SIZE 0
+#define SET_HEADER(p, val) (GET(p) = val)
+#define CHECK_LINK(a, h, prev, next)
+#define CHECK_HEADER(h)
+#define CHECK_BLOCK(ptr, size)
+#define GUARD_BLOCK(ptr, size)
+#define POISON_BLOCK(ptr, size)
+#endif
+// requests grow by the guard word, unless too big to be served anyway
+#define PADDED(size) (((size) > 0 && (size) <= MAX_MAPPED_SIZE) ? (size) + REDZONE_SIZE : (size))
 
 #define GET(p) (*(Header *)p).sa_bit //extracts header bits
 #define GET_HEADER(blk) (Header *)blk - 1
 #define GET_MEMORY(p) p + 1
 #define GET_USED(p) (GET(p) & 0x1) //gets least significant bit
-#define GET_SIZE(p) (GET(p) & ~0x7) // 3 LSB hold allocated status
-#define SET_HEADER(p, val) (GET(p) = val)
+#define GET_PREV_FREE(p) (GET(p) & 0x2) // set if block on the left is free
+#define GET_RELEASED(p) (GET(p) & 0x4) // free block whose pages went back to the OS
+#define GET_FLAGS(p) (GET(p) & 0x7)
+#ifdef COMPACT_HEADERS
+#define SIZE_MASK (~0x7U)
+#else
+#define SIZE_MASK (((1UL << OWNER_SHIFT) - 1) & ~0x7UL)
+#endif
+#define GET_SIZE(p) (GET(p) & SIZE_MASK) // 3 LSB hold allocated status
 #define SET_USED(p) (GET(p) |=  0x1)
 #define SET_UNUSED(p) (GET(p) &= ~0x1)
+#define SET_PREV_FREE(p) (GET(p) |= 0x2)
+#define CLEAR_PREV_FREE(p) (GET(p) &= ~0x2)
+#define SET_RELEASED(p) (GET(p) |= 0x4)
+#define CLEAR_RELEASED(p) (GET(p) &= ~0x4)
 #define GET_NEXT_HEADER(p) (Header*)((char*)p + GET_SIZE(p))
+// free blocks (other than end) repeat their size in a footer so the
+// block on their right can find their header
+#define GET_FOOTER(p) ((Header*)((char*)p + GET_SIZE(p)) - 1)
+#define SET_FOOTER(p) (GET(GET_FOOTER(p)) = GET_SIZE(p))
+#define GET_PREV_HEADER(p) (Header*)((char*)p - GET_SIZE(((Header*)p - 1)))
 #define GET_LISTPOINTERS(p) (ListPointers *)((Header*)p + 1)
-#define SET_NEXT_PTR(p1, p2) p1->next = p2->next
+#define LIST_PREV(p) FROM_LINK((GET_LISTPOINTERS(p))->prev)
+#define LIST_NEXT(p) FROM_LINK((GET_LISTPOINTERS(p))->next)
+#define SET_LIST_PREV(p, h) ((GET_LISTPOINTERS(p))->prev = TO_LINK(h))
+#define SET_LIST_NEXT(p, h) ((GET_LISTPOINTERS(p))->next = TO_LINK(h))
+// bits above the size name the thread cache an allocated block was handed
+// out from (0 if none), so a free from another thread can send it home
+#define OWNER_SHIFT 40
+#define OWNER_MASK 0xFFUL
+#ifdef COMPACT_HEADERS
+#define GET_OWNER(p) ((void)(p), 0)
+#else
+#define GET_OWNER(p) ((GET(p) >> OWNER_SHIFT) & OWNER_MASK)
+#endif
+#define SET_OWNER(p, id) (GET(p) = (GET(p) & ~(OWNER_MASK << OWNER_SHIFT)) | ((size_t)(id) << OWNER_SHIFT))
                                                                     
+#ifdef COMPACT_HEADERS
+typedef struct header {
+    uint32_t sa_bit; // stores size and allocation status
+} Header;
+
+typedef struct pointers { // offsets from segment_start, 0 for none
+    uint32_t prev;
+    uint32_t next;
+} ListPointers;
+
+#define TO_LINK(h) ((h) ? (uint32_t)((char *)(h) - (char *)segment_start) : 0)
+#define FROM_LINK(off) ((off) ? (Header *)((char *)segment_start + (off)) : NULL)
+#else
 typedef struct header {
     size_t sa_bit; // stores size and allocation status
 } Header;
@@ -33,30 +238,213 @@ typedef struct pointers {
     Header *next;
 } ListPointers;
 
-// global variable for  start of linked list
+#ifdef HARDENED
+#define TO_LINK(h) ((Header *)((uintptr_t)(h) ^ heap_secret))
+#define FROM_LINK(off) ((Header *)((uintptr_t)(off) ^ heap_secret))
+#else
+#define TO_LINK(h) (h)
+#define FROM_LINK(off) (off)
+#endif
+#endif
+
+// Slabs: page-aligned heap blocks cut into equal-sized objects with no
+// header. Build with -DSLAB_MAX_SIZE=0 to turn them off
+#ifndef SLAB_MAX_SIZE
+#define SLAB_MAX_SIZE 256 // largest request served from a slab
+#endif
+#if SLAB_MAX_SIZE > 256
+#error "slab size classes stop at 256 bytes"
+#endif
+#define SLAB_SIZE 4096 // slab blocks tile the heap one page apart
+#ifdef CACHE_ALIGNED
+#define SLAB_CLASSES 9
+#else
+#define SLAB_CLASSES 14
+#endif
+#define SLAB_MAP_WORDS (SLAB_SIZE / 8 / 64) // free bits for up to 512 objects
+
+typedef struct slab {
+    struct slab *prev; // neighbours on the list the slab is kept on
+    struct slab *next;
+    unsigned long free_map[SLAB_MAP_WORDS]; // bit set if the slot is free
+    size_t owner; // thread cache that allocates from the slab, 0 if none
+    unsigned short obj_size;
+    unsigned short nobjs;
+    unsigned short nfree;
+    unsigned short size_class;
+    unsigned int obj_recip; // 2^32 / obj_size rounded up, to divide by multiplying
+} Slab;
+
+// An arena is an independent heap on its own slice of the segment.
+// The single-threaded build uses one arena covering the whole segment
+typedef struct arena {
+    Header *top; // first block of the slice
+    Header *end; // remaining heap segment, never on a free list
+    size_t size; // bytes in the slice
+    size_t nused;
+    char *committed; // slice committed up to here
+    char *dirty; // highest address in the slice the heap has written
+    char *zeroed; // the slice reads as zeros from here on, at or past dirty
+    Header *free_lists[NUM_SIZE_CLASSES]; // front of each size class list
+    unsigned long nonempty_classes; // bit i set if free_lists[i] non-empty
+    Slab *slabs[SLAB_CLASSES]; // slabs with free slots not owned by a thread
+    size_t searches[STATS_CLASSES]; // free list searches by payload size class
+    size_t searched[STATS_CLASSES]; // blocks those searches examined
+    Header *quick[QUICK_BINS]; // parked blocks by size / BLOCK_ALIGN, linked through LIST_NEXT
+    int quick_counts[QUICK_BINS];
+    unsigned long quick_map[QUICK_MAP_WORDS]; // bit set if the quick list is non-empty
+    size_t parked; // payload bytes parked, not counted in nused
+#ifdef THREAD_SAFE
+    pthread_mutex_t lock;
+    int nthreads; // threads assigned to the arena
+    void *remote_frees; // objects freed while the lock was taken, pushed without it
+#endif
+} Arena;
+
+// calls and usable bytes counted at the API boundary (see the
+// statistics section at the bottom of this file)
+typedef struct op_stats {
+    size_t mallocs;
+    size_t reallocs;
+    size_t frees;
+    size_t given; // usable bytes handed out
+    size_t taken; // usable bytes given back
+    size_t allocs[STATS_CLASSES]; // mallocs by requested size class
+} OpStats;
+
+#ifdef THREAD_SAFE
+#define MAX_ARENAS 64
+#define MIN_ARENA_SIZE (64L << 20) // smaller slices mean fewer arenas
+// one arena per CPU unless -DNUM_ARENAS=n is given
+#else
+#define MAX_ARENAS 1
+#endif
+
+// global variables
 static Header *segment_start;
-static size_t nused;
 static size_t segment_size;
-static Header *base; //start of linkedlist
-static ListPointers *start; // base ptrs
-static Header *top;
-static Header *end;
+static Arena arenas[MAX_ARENAS];
+static int num_arenas;
+static char *heap_base; // first arena slice, after the page map
+static size_t arena_span; // bytes per slice; the last slice takes the rest
+static unsigned long *page_map; // one bit per segment page, set if a slab is there
+static OpStats shared_stats; // every call, or threads without a cache if thread-safe
+static size_t peak_bytes; // highest live byte count seen
+static bool release_zeroes; // released pages read back as zeros
+#ifdef HARDENED
+static size_t heap_secret; // keys canaries, links and guards
+#endif
+#if PROFILE_RATE > 0
+static unsigned char profile_filter[1 << PROFILE_FILTER_BITS]; // live samples by address hash
+static __thread long bytes_until_sample; // the allocation taking this below 0 is sampled
+#ifdef THREAD_SAFE
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER; // the profile's tables
+#endif
+#endif
+
+// object size of each slab class, and the class for each request size
+// in 8-byte steps. Requests are rounded up to ALIGNMENT first, so with 16
+// the 8- and 24-byte classes go unused
+#ifdef CACHE_ALIGNED
+static const unsigned short slab_sizes[SLAB_CLASSES] = {
+    8, 16, 24, 32, 48, 64, 128, 192, 256
+};
+#else
+static const unsigned short slab_sizes[SLAB_CLASSES] = {
+    8, 16, 24, 32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256
+};
+#endif
+#if SLAB_MAX_SIZE > 0 && defined(CACHE_ALIGNED)
+static const unsigned char slab_class_of[256 / 8 + 1] = {
+    0, 0, 1, 2, 3, 4, 4, 5, 5, 6, 6, 6, 6, 6, 6, 6, 6,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 8, 8, 8, 8, 8, 8, 8
+};
+#elif SLAB_MAX_SIZE > 0
+static const unsigned char slab_class_of[256 / 8 + 1] = {
+    0, 0, 1, 2, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9,
+    10, 10, 10, 10, 11, 11, 11, 11, 12, 12, 12, 12, 13, 13, 13, 13
+};
+#endif
 
 //helper function header
-void merge(ListPointers  *lp_ptr, ListPointers *lp_next);
-size_t adjust_block_size(size_t size);
-void print_heap();
-void print_linked_list();
-Header *make_new_allocation(size_t allocate_size);
-void allocate_usable_block(Header* block_head);
-Header *find_block_header(size_t size);
-void middle_merging(ListPointers *cur_lp, ListPointers *next_lp, bool cur_allocated);
-void base_merging(ListPointers *cur_lp, ListPointers *next_lp, bool cur_allocated);
-void end_merging(ListPointers *cur_lp, ListPointers *next_lp, Header* old_base);
-void make_smaller_block(Header *cur_head, size_t adjusted_size, size_t old_size);
-bool can_inplace_realloc(Header *cur_head, size_t new_size);
-bool check_alignment();
-bool check_heap_size();
+void *heap_malloc(Arena *a, size_t requested_size);
+void *heap_calloc(Arena *a, size_t requested_size);
+void *heap_alloc(Arena *a, size_t requested_size, bool zero);
+void clear_except(char *ptr, size_t size, char *lo, char *hi);
+void heap_free(Arena *a, void *ptr);
+void park_block(Arena *a, Header *head);
+void *quick_take(Arena *a, size_t bin);
+void sweep_quick_lists(Arena *a);
+void *heap_realloc(Arena *a, void *old_ptr, size_t new_size);
+size_t heap_malloc_batch(Arena *a, size_t requested_size, size_t n, void **out);
+size_t carve_blocks(Arena *a, Header *head, size_t total_size, size_t max, void **out);
+size_t free_run(Arena *a, void **ptrs, size_t i, size_t n);
+bool is_plain_block(void *ptr);
+int compare_ptrs(const void *a, const void *b);
+void sort_ptrs(void **ptrs, size_t n);
+void reset_thread_caches();
+int size_class(size_t size);
+void add_to_list(Arena *a, Header *head);
+void remove_from_list(Arena *a, Header *head);
+void merge(Arena *a, Header *cur_head, Header *next_head);
+void release_block(Arena *a, Header *head);
+size_t adjusted_block_size(size_t size);
+void print_heap(Arena *a);
+void print_linked_list(Arena *a);
+void *make_new_allocation(Arena *a, size_t allocate_size);
+void allocate_usable_block(Arena *a, Header* block_head);
+Header *find_block_header(Arena *a, size_t size);
+void make_smaller_block(Arena *a, Header *cur_head, size_t adjusted_size, size_t old_size);
+bool can_inplace_realloc(Arena *a, Header *cur_head, size_t new_size);
+void *grow_into_prev(Arena *a, Header *cur_head, size_t new_size, size_t live);
+Arena *arena_of(void *ptr);
+void *heap_memalign(Arena *a, size_t align, size_t requested_size);
+bool extend_heap(Arena *a, char *limit);
+void trim_end(Arena *a);
+void release_pages(Header *head, char *start, char *stop);
+bool is_slab_object(void *ptr);
+Slab *slab_of(void *ptr);
+Slab *new_slab(Arena *a, int cls, size_t owner);
+void release_slab(Arena *a, Slab *slab);
+void slab_link(Slab **list, Slab *slab);
+void slab_unlink(Slab **list, Slab *slab);
+void *slab_take(Slab **partial, Slab **full, int cls);
+bool slab_put(Slab **partial, Slab **full, Slab *slab, void *ptr);
+void *slab_malloc(Arena *a, int cls);
+void *slab_realloc(void *old_ptr, size_t new_size);
+size_t payload_size(void *ptr);
+void *move_block(void *old_ptr, size_t new_size);
+bool is_mapped(void *ptr);
+void *mmap_malloc(size_t requested_size);
+void mmap_free(void *ptr);
+void *mmap_realloc(void *old_ptr, size_t new_size);
+void *route_malloc(size_t requested_size);
+void *route_calloc(size_t requested_size);
+void route_free(void *ptr);
+void *route_realloc(void *old_ptr, size_t new_size);
+void *route_memalign(size_t align, size_t requested_size);
+size_t route_malloc_batch(size_t requested_size, size_t n, void **out);
+void route_free_batch(void **ptrs, size_t n);
+int stats_class(size_t size);
+void count_call(int call, size_t calls, size_t requested_size, size_t given, size_t taken);
+void add_op_stats(OpStats *total, OpStats *st);
+bool check_blocks(Arena *a, size_t *nfree);
+bool check_free_lists(Arena *a, size_t nfree);
+bool check_quick_lists(Arena *a);
+bool heap_error(const char *msg, void *where);
+void sample_validate();
+size_t canary_of(Header *head, size_t size);
+size_t seal(Header *head, size_t val);
+bool canary_ok(Header *head);
+void check_header(Header *head);
+void check_link(Arena *a, Header *head, Header *prev, Header *next);
+void check_block(void *ptr, size_t size);
+size_t usable_size(void *ptr);
+void heap_corrupt(const char *msg, void *where);
+void profile_alloc(void *ptr, size_t size);
+void profile_free(void *ptr);
+void profile_reset();
+size_t profile_gap();
 
 // rounds up sz to closest multiple of mult
 size_t roundup(size_t sz, size_t mult) {
@@ -66,463 +454,2789 @@ size_t roundup(size_t sz, size_t mult) {
 // rounds up based on minimum size or alignment
 size_t adjusted_block_size(size_t size) {
     if((size + HEADER_SIZE) < MIN_BLOCK_SIZE) {
-        return MIN_BLOCK_SIZE;
+        return roundup(MIN_BLOCK_SIZE, BLOCK_ALIGN);
     } else {
-        return roundup(size + HEADER_SIZE, ALIGNMENT);
+        return roundup(size + HEADER_SIZE, BLOCK_ALIGN);
     }
 }
+
+// returns the free list a block of the given total size belongs to:
+// floor(log2(size)) offset so the smallest blocks land in class 0
+int size_class(size_t size) {
+#if SEGREGATED_FIT
+    int cls = (int)(sizeof(long) * 8 - 1) - __builtin_clzl(size) - MIN_CLASS_SHIFT;
+    return (cls < NUM_SIZE_CLASSES) ? cls : NUM_SIZE_CLASSES - 1;
+#else
+    return 0;
+#endif
+}
+
 // initialize heap and return status of this initialization
 bool myinit(void *heap_start, size_t heap_size) {
     
     if (heap_size < MIN_BLOCK_SIZE) { 
         return false;
     }
+#ifdef COMPACT_HEADERS
+    if (heap_size > MAX_COMPACT_SEGMENT) { // the rest is left alone
+        heap_size = MAX_COMPACT_SEGMENT;
+    }
+#endif
 
     // initialize global variables and clear heap
+#ifdef HARDENED
+    if (getrandom(&heap_secret, sizeof(heap_secret), GRND_NONBLOCK) != sizeof(heap_secret)) {
+        struct timespec ts; // no entropy yet: the clock and ASLR will do
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        heap_secret = (ts.tv_sec * 1000000007UL) ^ ts.tv_nsec ^ (uintptr_t)&ts ^ (uintptr_t)heap_start;
+    }
+#endif
+    // a heap on the memory of the last one can't take what that one wrote
+    // for zeros: arenas laid out alike keep their own marks, otherwise
+    // everything up to the highest of them counts as written
+    bool same_layout = (heap_start == segment_start && heap_size == segment_size);
+    int old_arenas = num_arenas;
+    char *written = NULL;
+    for (int i = 0; i < old_arenas; i++) {
+        if (arenas[i].zeroed > written) {
+            written = arenas[i].zeroed;
+        }
+    }
+    release_zeroes = heap_segment_zeroes(heap_start, heap_size);
     segment_start = heap_start;
     segment_size = heap_size;
-    top = segment_start;
-    SET_HEADER(top, segment_size);
-    end = top;
-    base = top;
-    start = GET_LISTPOINTERS(base);
-    start->prev = NULL;
-    start->next = NULL;
+    size_t map_size = 0;
+    if (SLAB_MAX_SIZE > 0) { // page map at the front, arenas start on the next page
+        map_size = roundup(roundup(heap_size / SLAB_SIZE + 2, 64) / 8, SLAB_SIZE);
+        if (heap_size < map_size + SLAB_SIZE) {
+            return false;
+        }
+        page_map = heap_start;
+        if (!heap_segment_commit(page_map, map_size)) {
+            return false;
+        }
+        memset(page_map, 0, map_size);
+    }
+    heap_base = (char *)heap_start + map_size;
+    heap_size -= map_size;
+    num_arenas = 1;
+#ifdef THREAD_SAFE
+#ifdef NUM_ARENAS
+    long ncpus = NUM_ARENAS; // fixed at build time
+#else
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    while (num_arenas < ncpus && num_arenas < MAX_ARENAS &&
+           heap_size / (num_arenas + 1) >= MIN_ARENA_SIZE) {
+        num_arenas++;
+    }
+#endif
+    // slices start on page boundaries
+    arena_span = (num_arenas == 1) ? heap_size : (heap_size / num_arenas) & ~4095UL;
+    for (int i = 0; i < num_arenas; i++) {
+        Arena *a = &arenas[i];
+        memset(a->free_lists, 0, sizeof(a->free_lists));
+        memset(a->slabs, 0, sizeof(a->slabs));
+        memset(a->searches, 0, sizeof(a->searches));
+        memset(a->searched, 0, sizeof(a->searched));
+        memset(a->quick, 0, sizeof(a->quick));
+        memset(a->quick_counts, 0, sizeof(a->quick_counts));
+        memset(a->quick_map, 0, sizeof(a->quick_map));
+        a->parked = 0;
+        a->nonempty_classes = 0;
+        a->nused = 0;
+#ifdef THREAD_SAFE
+        pthread_mutex_init(&a->lock, NULL); // before any thread can take it
+        a->remote_frees = NULL;
+#endif
+        // the first header sits so that payloads land on BLOCK_ALIGN
+        a->top = (Header *)(heap_base + i * arena_span + BLOCK_ALIGN - HEADER_SIZE);
+        a->size = (i == num_arenas - 1) ? heap_size - i * arena_span : arena_span;
+        a->size = (a->size - (BLOCK_ALIGN - HEADER_SIZE)) & ~(size_t)(BLOCK_ALIGN - 1);
+        char *slice_end = (char *)a->top + a->size;
+        char *seen = (same_layout && num_arenas == old_arenas) ? a->zeroed : written;
+        a->committed = a->dirty = a->zeroed = (char *)a->top;
+        if (!release_zeroes || seen > slice_end) { // memory not ours, or all of it written
+            a->zeroed = slice_end;
+        } else if (seen > a->zeroed) {
+            a->zeroed = seen;
+        }
+        if (!extend_heap(a, (char *)a->top + HEADER_SIZE)) {
+            return false;
+        }
+        SET_HEADER(a->top, a->size);
+        a->end = a->top;
+    }
+    memset(&shared_stats, 0, sizeof(shared_stats));
+    peak_bytes = 0;
+#ifdef THREAD_SAFE
+    reset_thread_caches();
+#endif
+#if PROFILE_RATE > 0
+    profile_reset();
+#endif
     
     return true;
 }
 
+// returns the arena whose slice holds ptr
+Arena *arena_of(void *ptr) {
+    size_t index = ((char *)ptr - heap_base) / arena_span;
+    return &arenas[(index < num_arenas) ? index : num_arenas - 1];
+}
+
+// commits the arena's slice up to limit, a chunk at a time, before the
+// heap writes there. Returns false if the OS refuses
+bool extend_heap(Arena *a, char *limit) {
+    if (limit > a->committed) {
+        char *slice_end = (char *)a->top + a->size;
+        char *new_committed = (char *)a->top + roundup(limit - (char *)a->top, COMMIT_CHUNK);
+        if (new_committed > slice_end) {
+            new_committed = slice_end;
+        }
+        if (!heap_segment_commit(a->committed, new_committed - a->committed)) {
+            return false;
+        }
+        a->committed = new_committed;
+    }
+    if (limit > a->dirty) {
+        a->dirty = limit;
+    }
+    if (limit > a->zeroed) {
+        a->zeroed = limit;
+    }
+    return true;
+}
+
+// hands the pages of end the heap has written back to the OS once there
+// are RELEASE_THRESHOLD bytes of them. The page dirty ends in goes too,
+// so that all of end past clean reads as zeros if it was untouched before
+void trim_end(Arena *a) {
+#if RELEASE_THRESHOLD > 0
+    char *clean = (char *)roundup((size_t)a->end + HEADER_SIZE, PAGE_SIZE);
+    if (a->dirty > clean && a->dirty - clean >= RELEASE_THRESHOLD) {
+        char *stop = (char *)roundup((size_t)a->dirty, PAGE_SIZE);
+        heap_segment_release(clean, stop - clean);
+        if (release_zeroes && a->zeroed <= stop) {
+            a->zeroed = clean;
+        }
+        a->dirty = clean;
+    }
+#endif
+}
+
+// hands back the pages overlapping [start, stop) that lie wholly inside
+// a free block, clear of its header, list pointers and footer
+void release_pages(Header *head, char *start, char *stop) {
+    size_t lo = roundup((size_t)head + HEADER_SIZE + sizeof(ListPointers), PAGE_SIZE);
+    size_t hi = (size_t)GET_FOOTER(head) & ~(PAGE_SIZE - 1UL);
+    size_t from = (size_t)start & ~(PAGE_SIZE - 1UL);
+    size_t to = roundup((size_t)stop, PAGE_SIZE);
+    if (from < lo) {
+        from = lo;
+    }
+    if (to > hi) {
+        to = hi;
+    }
+    if (from < to) {
+        heap_segment_release((void *)from, to - from);
+    }
+}
+
+void *heap_malloc(Arena *a, size_t requested_size) {
+    return heap_alloc(a, requested_size, false);
+}
+
+// like heap_malloc, but the first requested_size bytes read as zeros
+void *heap_calloc(Arena *a, size_t requested_size) {
+    return heap_alloc(a, requested_size, true);
+}
+
 // function that allocates memory onto the heap either
 // by finding suitable free block given requested size
-// or by making a new allocation
-void *mymalloc(size_t requested_size) {
-    size_t total_size = adjusted_block_size(requested_size);
-    
-    if (nused >= segment_size || requested_size == 0 || requested_size > MAX_REQUEST_SIZE) {
+// or by making a new allocation. With zero set it clears the payload,
+// skipping the pages of a released block and anything past zeroed
+void *heap_alloc(Arena *a, size_t requested_size, bool zero) {
+    if (requested_size == 0 || requested_size > MAX_REQUEST_SIZE) {
         return NULL;
     }
+    size_t total_size = adjusted_block_size(requested_size);
+    if (total_size <= QUICK_MAX_SIZE && a->quick[total_size / BLOCK_ALIGN]) {
+        void *ptr = quick_take(a, total_size / BLOCK_ALIGN);
+        if (zero) {
+            memset(ptr, 0, requested_size);
+        }
+        return ptr;
+    }
+    Header *usable_blk_head = find_block_header(a, total_size);
+    if (usable_blk_head == a->end && a->parked > 0) { // miss: coalesce, look again
+        sweep_quick_lists(a);
+        usable_blk_head = find_block_header(a, total_size);
+    }
     
-    void *block; //block to be returned
-    Header *usable_blk_head = find_block_header(total_size);
-    
-    if (usable_blk_head != end) { // recyclable block found
-        allocate_usable_block(usable_blk_head);
+    if (usable_blk_head != a->end) { // recyclable block found
+        char *lo = NULL, *hi = NULL; // pages handed back while it was free
+        if (zero && release_zeroes && GET_RELEASED(usable_blk_head)) {
+            lo = (char *)roundup((size_t)usable_blk_head + HEADER_SIZE + sizeof(ListPointers), PAGE_SIZE);
+            hi = (char *)((size_t)GET_FOOTER(usable_blk_head) & ~(PAGE_SIZE - 1UL));
+        }
+        allocate_usable_block(a, usable_blk_head);
         size_t blk_size = GET_SIZE(usable_blk_head);
-        nused += (blk_size - HEADER_SIZE);
+        if (blk_size - total_size >= MIN_BLOCK_SIZE) { // give back the tail
+            make_smaller_block(a, usable_blk_head, total_size, blk_size);
+        }
+        CLEAR_RELEASED(usable_blk_head);
+        a->nused += (GET_SIZE(usable_blk_head) - HEADER_SIZE);
+        if (zero) {
+            clear_except((char *)(GET_MEMORY(usable_blk_head)), requested_size, lo, hi);
+        }
         return GET_MEMORY(usable_blk_head);   
-    } else {
-        block = make_new_allocation(total_size);
     }
-    return block;
+    char *zeroed = a->zeroed; // before the block takes it
+    void *ptr = make_new_allocation(a, total_size);
+    if (zero && ptr) {
+        clear_except(ptr, requested_size, zeroed, (char *)a->top + a->size);
+    }
+    return ptr;
 }
 
-// function that allocates a block that is found to be
-// usable and returns the block with its updated pointers
-void allocate_usable_block(Header* block_head) {
-     // deal with 4 possible cases
-     // 1) cur_head has a valid prev and next (ie cur_head in middle of linkedlist)
-     // 2) cur_head has a prev but no next (ie cur_head is last in linked_list)
-     // 3) cur_head has a next but no prev (ie cur_head is base with other nodes in list)
-     // 4) cur_head has neither next nor prev (ie cur_head is only node in linkedlist)
-             
-    ListPointers *lp_blk = GET_LISTPOINTERS(block_head);
-    ListPointers *next_blk = GET_LISTPOINTERS(lp_blk->next);
-    next_blk->prev = lp_blk->prev;
+// clears size bytes at ptr, except those in [lo, hi), which already
+// read as zeros
+void clear_except(char *ptr, size_t size, char *lo, char *hi) {
+    char *stop = ptr + size;
+    if (lo >= hi || lo >= stop || hi <= ptr) {
+        memset(ptr, 0, size);
+        return;
+    }
+    if (lo > ptr) {
+        memset(ptr, 0, lo - ptr);
+    }
+    if (hi < stop) {
+        memset(hi, 0, stop - hi);
+    }
+}
+
+// allocates up to n blocks of requested_size into out, carving as many
+// as fit out of each free block (or end) it takes: a run costs one
+// search and one round of list surgery rather than one per block. Holes
+// are filled before end when no free block holds the whole run.
+// Returns the number of blocks allocated
+size_t heap_malloc_batch(Arena *a, size_t requested_size, size_t n, void **out) {
+    if (requested_size == 0 || requested_size > MAX_REQUEST_SIZE) {
+        return 0;
+    }
+    size_t total_size = adjusted_block_size(requested_size);
+    size_t count = 0;
+    bool holes = false; // no free block holds the rest: fill holes, then end
     
-    if (lp_blk->prev) {
-        ListPointers *lp_before_cur = GET_LISTPOINTERS(lp_blk->prev);
-        if (lp_blk->next) { // case 1
-            ListPointers *lp_after_next = GET_LISTPOINTERS(lp_blk->next);
-            lp_before_cur->next = lp_blk->next;
-            lp_after_next->prev = lp_blk->prev;
-        } else { // case 2
-            lp_before_cur = NULL;
-        }
-           
-    } else {
-        if (lp_blk->next) { // case 3
-            base = lp_blk->next;
-            start = GET_LISTPOINTERS(base);
-            start->prev = NULL;
-        } else { // case 4
-            base = NULL;
-            start = NULL;
+    while (count < n) {
+        size_t left = n - count;
+        if (left > MAX_REQUEST_SIZE / total_size) {
+            left = MAX_REQUEST_SIZE / total_size;
+        }
+        Header *head = a->end;
+        if (!holes) {
+            head = find_block_header(a, left * total_size);
+            holes = (head == a->end);
+        }
+        if (holes) {
+            head = find_block_header(a, total_size);
+        }
+        size_t carved = carve_blocks(a, head, total_size, left, out + count);
+        if (carved == 0) {
+            break;
+        }
+        count += carved;
+    }
+    return count;
+}
+
+// lays up to max used blocks of total_size side by side from the start
+// of a free block or end, handing back what is left in one piece: the
+// rest of end stays end, and the rest of a free block is freed unless it
+// is too small for a block, when the last block absorbs it. Returns the
+// number of blocks carved
+size_t carve_blocks(Arena *a, Header *head, size_t total_size, size_t max, void **out) {
+    size_t blk_size = GET_SIZE(head);
+    size_t prev_free = GET_PREV_FREE(head);
+    size_t released = GET_RELEASED(head); // the leftover's pages are gone too
+    size_t count = (head == a->end) ? (blk_size - MIN_BLOCK_SIZE) / total_size : blk_size / total_size;
+    if (head == a->end && blk_size < total_size + MIN_BLOCK_SIZE) { // end must survive
+        return 0;
+    }
+    if (count > max) {
+        count = max;
+    }
+    size_t rest = blk_size - count * total_size;
+    if (head == a->end) {
+        if (!extend_heap(a, (char *)head + count * total_size + HEADER_SIZE)) {
+            return 0;
         }
+        a->end = (Header *)((char *)head + count * total_size);
+        SET_HEADER(a->end, rest);
+        rest = 0;
+    } else {
+        allocate_usable_block(a, head);
+    }
+    size_t last_size = (rest < MIN_BLOCK_SIZE) ? total_size + rest : total_size;
+    Header *cur = head;
+    for (size_t i = 0; i < count; i++) {
+        size_t size = (i == count - 1) ? last_size : total_size;
+        SET_HEADER(cur, size | 1 | (i == 0 ? prev_free : 0));
+        out[i] = GET_MEMORY(cur);
+        a->nused += size - HEADER_SIZE;
+        cur = (Header *)((char *)cur + size);
+    }
+    if (head != a->end && rest >= MIN_BLOCK_SIZE) {
+        SET_HEADER(cur, rest | released);
+        release_block(a, cur);
+    }
+    return count;
+}
+
+// pushes a free block onto the front of the list for its size class
+void add_to_list(Arena *a, Header *head) {
+    int cls = size_class(GET_SIZE(head));
+    Header *next = a->free_lists[cls];
+    SET_LIST_PREV(head, NULL);
+    SET_LIST_NEXT(head, next);
+    if (next) {
+        SET_LIST_PREV(next, head);
     }
+    a->free_lists[cls] = head;
+    a->nonempty_classes |= 1UL << cls;
+}
+
+// unlinks a free block from its size class list. Must be called
+// before the block's header size changes
+void remove_from_list(Arena *a, Header *head) {
+    int cls = size_class(GET_SIZE(head));
+    Header *prev = LIST_PREV(head);
+    Header *next = LIST_NEXT(head);
+    CHECK_LINK(a, head, prev, next);
     
+    if (prev) {
+        SET_LIST_NEXT(prev, next);
+    } else { // block is front of its list
+        a->free_lists[cls] = next;
+        if (!next) {
+            a->nonempty_classes &= ~(1UL << cls);
+        }
+    }
+    if (next) {
+        SET_LIST_PREV(next, prev);
+    }
+}
+
+// function that allocates a block that is found to be
+// usable: takes it off its free list and marks it used
+void allocate_usable_block(Arena *a, Header* block_head) {
+    remove_from_list(a, block_head);
     SET_USED(block_head);
-    lp_blk->next= NULL;
-    lp_blk->prev = NULL;
+    CLEAR_PREV_FREE(GET_NEXT_HEADER(block_head));
 }
 
 
 // makes new allocation at end of heap where the end  is the free
-// remaining block of heap left segment. Returns new block
-Header *make_new_allocation(size_t allocate_size) {
-    Header *cur_head = end;
+// remaining block of heap left segment. Returns new block, or NULL
+// if the remaining segment is too small
+void *make_new_allocation(Arena *a, size_t allocate_size) {
+    Header *cur_head = a->end;
     size_t old_blk_size = GET_SIZE(cur_head);
-    ListPointers *old_ls = GET_LISTPOINTERS(cur_head);
-    size_t header = allocate_size + 1;  // +1 for allocated
-  
-    SET_HEADER(cur_head, header);
-    nused += allocate_size;
-    Header *remaining_seg = GET_NEXT_HEADER(cur_head);
     
-    if (cur_head == base) { //remaining heap seg is only node, must update base
-        base = GET_NEXT_HEADER(cur_head);
-        start = GET_LISTPOINTERS(base);
-        start->next = NULL;
-        start->prev = NULL;
-        SET_HEADER(base, old_blk_size - allocate_size);
-           
-    } else { //allocate from reamining segment of heap
-        ListPointers *new_remain = GET_LISTPOINTERS(remaining_seg);
-        ListPointers *prev_node = GET_LISTPOINTERS(old_ls->prev);
-        prev_node->next = remaining_seg;
-        new_remain->prev = old_ls->prev;
-        new_remain->next = NULL;
-        SET_HEADER(remaining_seg, old_blk_size - allocate_size);
-    }
-    old_ls->prev = NULL; //allocated block's ptr
-    end = remaining_seg;
+    if (old_blk_size < allocate_size + MIN_BLOCK_SIZE) { // end must survive
+        return NULL;
+    }
+    if (!extend_heap(a, (char *)cur_head + allocate_size + HEADER_SIZE)) {
+        return NULL;
+    }
+    SET_HEADER(cur_head, allocate_size + 1 + GET_PREV_FREE(cur_head));  // +1 for allocated
+    a->end = GET_NEXT_HEADER(cur_head);
+    SET_HEADER(a->end, old_blk_size - allocate_size);
+    a->nused += (allocate_size - HEADER_SIZE);
     return GET_MEMORY(cur_head);
 }
 
+// allocates a block whose payload starts on a multiple of align (a power
+// of two of at least ALIGNMENT). A free block or end big enough to hold
+// the block at any offset is split: the slack in front goes back to the
+// free lists as its own block, and the aligned block is carved out of
+// the rest like a normal allocation
+void *heap_memalign(Arena *a, size_t align, size_t requested_size) {
+    if (requested_size == 0 || requested_size > MAX_REQUEST_SIZE) {
+        return NULL;
+    }
+    size_t total_size = adjusted_block_size(requested_size);
+    Header *head = find_block_header(a, total_size + align + MIN_BLOCK_SIZE);
+    if (head == a->end && GET_SIZE(head) < total_size + align + 2 * MIN_BLOCK_SIZE) {
+        return NULL;
+    }
+    
+    char *payload = (char *)roundup((size_t)(GET_MEMORY(head)), align);
+    size_t lead = payload - (char *)(GET_MEMORY(head));
+    if (lead != 0 && lead < MIN_BLOCK_SIZE) { // slack must be a block of its own
+        payload += roundup(MIN_BLOCK_SIZE - lead, align);
+        lead = payload - (char *)(GET_MEMORY(head));
+    }
+    if (head == a->end && !extend_heap(a, payload + total_size)) {
+        return NULL;
+    }
+    size_t blk_size = GET_SIZE(head);
+    if (head != a->end) {
+        allocate_usable_block(a, head);
+    }
+    Header *aligned = head;
+    if (lead > 0) { // split off the slack and free it
+        aligned = (Header *)((char *)head + lead);
+        if (head == a->end) {
+            a->end = aligned;
+        }
+        SET_HEADER(aligned, (blk_size - lead) | GET_USED(head) | GET_RELEASED(head));
+        SET_HEADER(head, lead | GET_PREV_FREE(head));
+        SET_FOOTER(head);
+        add_to_list(a, head);
+        SET_PREV_FREE(aligned);
+        blk_size -= lead;
+    }
+    if (aligned == a->end) {
+        return make_new_allocation(a, total_size);
+    }
+    if (blk_size - total_size >= MIN_BLOCK_SIZE) { // give back the tail
+        make_smaller_block(a, aligned, total_size, blk_size);
+    }
+    CLEAR_RELEASED(aligned);
+    a->nused += (GET_SIZE(aligned) - HEADER_SIZE);
+    return GET_MEMORY(aligned);
+}
+
 // function that searches for a free, usable block of at least
-// total_size using first-fit (block with lowest amt of enough free space)
-Header *find_block_header(size_t total_size) {
-    Header *best_blk_head = end;
-    Header *head = base;
-    ListPointers *old_lp = GET_LISTPOINTERS(head);
-    size_t cur_blk_size = GET_SIZE(head);
+// total_size. Only the first few blocks of the request's own class are
+// probed (they may be too small); after that the bitmap gives the first
+// non-empty larger class, where any block fits. Returns end if no list
+// has a usable block
+Header *find_block_header(Arena *a, size_t total_size) {
+    int cls = size_class(total_size);
+    int stats_cls = stats_class(total_size - HEADER_SIZE);
+    Header *head = a->free_lists[cls];
+    size_t probes = 0;
     
-    while(old_lp->next) {
-        cur_blk_size = GET_SIZE(head);
-        if(cur_blk_size >= total_size && !GET_USED(head)) {
-            best_blk_head = head;
-            return best_blk_head;
+    a->searches[stats_cls]++;
+    for (; head && probes < MAX_CLASS_PROBES; probes++) {
+        if (GET_SIZE(head) >= total_size) {
+            a->searched[stats_cls] += probes + 1;
+            return head;
         }
-        old_lp = GET_LISTPOINTERS(head); 
-        head = old_lp->next;
+        head = LIST_NEXT(head);
+    }
+    a->searched[stats_cls] += probes;
+    unsigned long larger = a->nonempty_classes & ~((2UL << cls) - 1);
+    if (larger && cls != NUM_SIZE_CLASSES - 1) {
+        a->searched[stats_cls]++;
+        return a->free_lists[__builtin_ctzl(larger)];
     }
-    return best_blk_head;
+    return a->end;
 }
     
-// this function frees memory and adds the pointer onto the linked
-// list and merges with next block on right if possible
-// if pointer can't be merged, it goes to front of linkedlist
-void myfree(void *ptr) {
+// this function frees memory and hands the block back to the
+// free lists (see release_block), or parks it in a quick list
+void heap_free(Arena *a, void *ptr) {
     if (ptr == NULL) {
         return;
     }
     Header *head = GET_HEADER(ptr);
-    nused -= (GET_SIZE(head) - HEADER_SIZE);
-    ListPointers *ptr_lp = GET_LISTPOINTERS(head);
+    a->nused -= (GET_SIZE(head) - HEADER_SIZE);
+    if (GET_SIZE(head) <= QUICK_MAX_SIZE) {
+        park_block(a, head);
+        return;
+    }
+    release_block(a, head);
+}
+
+// frees the block at ptrs[i] (sorted by address) together with the
+// blocks right after it in memory that come next in ptrs, as one merged
+// block, so the run is coalesced once. Returns the index past the run
+size_t free_run(Arena *a, void **ptrs, size_t i, size_t n) {
+    Header *head = GET_HEADER(ptrs[i]);
+    size_t size = GET_SIZE(head);
+    a->nused -= size - HEADER_SIZE;
+    
+    for (i++; i < n && (char *)ptrs[i] == (char *)head + size + HEADER_SIZE &&
+                is_plain_block(ptrs[i]); i++) {
+        Header *next_head = GET_HEADER(ptrs[i]);
+        a->nused -= GET_SIZE(next_head) - HEADER_SIZE;
+        size += GET_SIZE(next_head);
+    }
+    SET_HEADER(head, size | GET_FLAGS(head));
+    release_block(a, head);
+    return i;
+}
+
+// marks a block free and coalesces it with both neighbours in O(1):
+// the right block through its header, the left block through the footer
+// it left behind. The result goes to the front of its size class list,
+// or becomes the new end if it reaches end.
+// A result of at least RELEASE_THRESHOLD bytes hands its pages back to
+// the OS and is marked released. Pieces that already were released (or,
+// for a block with the bit set on entry, split off one) only contribute
+// the pages around their old boundary, so each page is given back once
+void release_block(Arena *a, Header *head) {
     Header *next_head = GET_NEXT_HEADER(head);
+    char *dirty_start = (char *)head; // span that may hold written pages
+    char *dirty_end = GET_RELEASED(head) ? (char *)head + MIN_BLOCK_SIZE : (char *)next_head;
 
-    if (base && head != end && !GET_USED(next_head)) { // coalescing
-        ListPointers *next_lp = GET_LISTPOINTERS(next_head);
-        merge(ptr_lp, next_lp);
-        if(GET_HEADER(next_lp) == end) { //update block that's at end of heap
-            end = head;
+    if (GET_USED(next_head) || next_head == a->end) { // else checked as it is unlinked
+        CHECK_HEADER(next_head); // catches an overflow out of this block
+    }
+    SET_HEADER(head, GET_SIZE(head) | GET_PREV_FREE(head)); // unused, no owner
+    if (!GET_USED(next_head)) { // coalescing
+        if (next_head != a->end) {
+            dirty_end = GET_RELEASED(next_head) ? (char *)next_head + MIN_BLOCK_SIZE
+                                                : (char *)(GET_NEXT_HEADER(next_head));
         }
-    
-    } else { // if no merging, put new free ptr at front of linked list
-        start->prev = head;
-        ptr_lp->next = base;
-        ptr_lp->prev = NULL;
-        base = head;
-        start = GET_LISTPOINTERS(base);
+        merge(a, head, next_head);
+    }
+    if (GET_PREV_FREE(head)) {
+        Header *prev_head = GET_PREV_HEADER(head);
+        dirty_start = GET_RELEASED(prev_head) ? (char *)head - FOOTER_SIZE : (char *)prev_head;
+        remove_from_list(a, prev_head);
+        if (head == a->end) {
+            a->end = prev_head;
+        }
+        SET_HEADER(prev_head, (GET_SIZE(prev_head) + GET_SIZE(head)) | GET_PREV_FREE(prev_head));
+        head = prev_head;
+    }
+    if (head == a->end) {
+        trim_end(a);
+        return;
+    }
+    SET_FOOTER(head);
+    SET_PREV_FREE(GET_NEXT_HEADER(head));
+#if RELEASE_THRESHOLD > 0
+    if (GET_SIZE(head) >= RELEASE_THRESHOLD) {
+        release_pages(head, dirty_start, dirty_end);
+        SET_RELEASED(head);
     }
-    SET_UNUSED(head);
+#else
+    (void)dirty_start, (void)dirty_end; // nothing is ever released
+#endif
+    add_to_list(a, head);
 }
 
 // myrealloc tries to do in-place reallocation if possible
 // either if new_size smaller than old_size or through merging
 // creates smaller blocks out of larger coalesced blocks if
-// possible. Otherwise, moves memory to new location 
-void *myrealloc(void *old_ptr, size_t new_size) {
+// possible. Failing that it slides the block down into a free left
+// neighbour, and only then moves memory to a new location. The payload
+// is copied at most once, straight to where it ends up
+void *heap_realloc(Arena *a, void *old_ptr, size_t new_size) {
     if (old_ptr == NULL) {
-        return mymalloc(new_size);
+        return heap_malloc(a, new_size);
         
-    } else if (old_ptr != NULL && new_size == 0) { 
-        myfree(old_ptr);
+    } else if (new_size == 0) { 
+        heap_free(a, old_ptr);
         return NULL;
         
-    } else {
-        Header *cur_head = GET_HEADER(old_ptr);
-        size_t old_size = GET_SIZE(cur_head);
-        nused -= old_size;
-        size_t adjusted_size = adjusted_block_size(new_size);
-        char temp_data[old_size]; 
-        char *temp = &temp_data[0];
-        if (old_size != segment_size) { // store old data to be realloced
-            memcpy(temp, old_ptr, old_size);
-        }
-        
-        if (adjusted_size <= old_size) {   // guaranteed can in-place realloc
-            memmove(old_ptr, old_ptr, new_size);
-            if ((old_size - adjusted_size) < MIN_BLOCK_SIZE) { // too small for  new block
-                nused += old_size;
-            } else { // big enough to create smaller blocks
-                make_smaller_block(cur_head, adjusted_size, old_size);
-                nused += adjusted_size;
-            }
-            return old_ptr;
-            
-        } else { // possibly can in-place realloc if coaslesce but maybe not
-            if (can_inplace_realloc(cur_head, new_size)) {
-                allocate_usable_block(cur_head);
-                memcpy(old_ptr, temp, old_size);
-                return old_ptr;
-            } else {  //can't be inplace realloced; must malloc
-                void *new_ptr = mymalloc(new_size);
-                nused += HEADER_SIZE; 
-                if (new_ptr == NULL) { //realloc failed
-                    return NULL;
-                }
-                memcpy(new_ptr, temp, old_size);
-                return new_ptr;
-            }
+    } else if (new_size > MAX_REQUEST_SIZE) {
+        return NULL;
+    }
+    Header *cur_head = GET_HEADER(old_ptr);
+    size_t old_size = GET_SIZE(cur_head);
+    size_t adjusted_size = adjusted_block_size(new_size);
+    
+    if (adjusted_size <= old_size) {   // guaranteed can in-place realloc
+        if ((old_size - adjusted_size) >= MIN_BLOCK_SIZE) { // big enough for new block
+            make_smaller_block(a, cur_head, adjusted_size, old_size);
         }
+        a->nused -= (old_size - GET_SIZE(cur_head));
+        return old_ptr;
+    }
+    // possibly can in-place realloc if coalesce but maybe not
+    bool inplace = can_inplace_realloc(a, cur_head, adjusted_size);
+    a->nused += (GET_SIZE(cur_head) - old_size); // block may have grown
+    if (inplace) {
+        return old_ptr;
+    }
+    void *new_ptr = grow_into_prev(a, cur_head, adjusted_size, old_size - HEADER_SIZE);
+    if (new_ptr) {
+        return new_ptr;
+    }
+    new_ptr = heap_malloc(a, new_size); //can't be inplace realloced; must malloc
+    if (new_ptr == NULL) { //realloc failed
+        return NULL;
     }
+    memcpy(new_ptr, old_ptr, old_size - HEADER_SIZE);
+    heap_free(a, old_ptr);
+    return new_ptr;
 }
 
-// function that tries to continuously merge free blocks for realloc
-// and returns status on whether in-place realloc is possible
-bool can_inplace_realloc(Header *cur_head, size_t new_size) {
-    size_t old_size = GET_SIZE(cur_head);
-    size_t updated_block_size = old_size;
-    ListPointers *lp_cur = GET_LISTPOINTERS(cur_head);
-    ListPointers *lp_next;
-    if (cur_head == end) {
-        return false;
+// grows a used block into the free block on its left if the two together
+// hold new_size: the payload (of which the first live bytes matter) slides
+// down to the start of the left block. Returns the new payload, or NULL
+// if the left block is used or too small
+void *grow_into_prev(Arena *a, Header *cur_head, size_t new_size, size_t live) {
+    if (!GET_PREV_FREE(cur_head)) {
+        return NULL;
     }
-    Header *next_head = GET_NEXT_HEADER(cur_head);
-    while (next_head && !GET_USED(next_head)) {
-        lp_next = GET_LISTPOINTERS(next_head);
-        merge(lp_cur, lp_next);
-        updated_block_size = GET_SIZE(cur_head);
+    Header *prev_head = GET_PREV_HEADER(cur_head);
+    size_t cur_size = GET_SIZE(cur_head);
+    size_t total_size = GET_SIZE(prev_head) + cur_size;
+    if (total_size < new_size) {
+        return NULL;
+    }
+    remove_from_list(a, prev_head);
+    SET_HEADER(prev_head, total_size | GET_PREV_FREE(prev_head) | 1);
+    memmove(GET_MEMORY(prev_head), GET_MEMORY(cur_head), live);
+    if (total_size - new_size >= MIN_BLOCK_SIZE) {
+        make_smaller_block(a, prev_head, new_size, total_size);
+    }
+    a->nused += (GET_SIZE(prev_head) - cur_size);
+    return GET_MEMORY(prev_head);
+}
 
-        if (next_head == end) {
-            end = cur_head;
-            return false;
-        }
-        if ((new_size + HEADER_SIZE) <= updated_block_size) { //can be in-place realloced
-            nused += updated_block_size;
+// function that tries to continuously merge free blocks on the right
+// into the (still allocated) block for realloc, falling back to taking
+// space from end, and returns status on whether in-place realloc is possible
+bool can_inplace_realloc(Arena *a, Header *cur_head, size_t new_size) {
+    Header *next_head = GET_NEXT_HEADER(cur_head);
+    CHECK_HEADER(next_head);
+    
+    while (next_head != a->end && !GET_USED(next_head)) {
+        merge(a, cur_head, next_head);
+        size_t updated_block_size = GET_SIZE(cur_head);
+        if (new_size <= updated_block_size) { //can be in-place realloced
+            if (updated_block_size - new_size >= MIN_BLOCK_SIZE) {
+                make_smaller_block(a, cur_head, new_size, updated_block_size);
+            }
             return true;
         }
         next_head = GET_NEXT_HEADER(cur_head); // try again
     }
+    if (next_head == a->end) { // grow into remaining heap segment
+        size_t end_size = GET_SIZE(a->end);
+        size_t needed = new_size - GET_SIZE(cur_head);
+        if (end_size >= needed + MIN_BLOCK_SIZE &&
+            extend_heap(a, (char *)cur_head + new_size + HEADER_SIZE)) {
+            SET_HEADER(cur_head, new_size + GET_FLAGS(cur_head));
+            a->end = GET_NEXT_HEADER(cur_head);
+            SET_HEADER(a->end, end_size - needed);
+            return true;
+        }
+    }
     return false;  
 }
 
     
 // function to make a smaller block if coalesced
-// block is big enough to create a smaller block
-void make_smaller_block(Header *cur_head, size_t adjusted_size, size_t old_size) {
-    SET_HEADER(cur_head, adjusted_size + 1);
+// block is big enough to create a smaller block.
+// The leftover piece is released to the free lists
+void make_smaller_block(Arena *a, Header *cur_head, size_t adjusted_size, size_t old_size) {
+    size_t released = GET_RELEASED(cur_head); // the leftover's pages are gone too
+    SET_HEADER(cur_head, adjusted_size + GET_FLAGS(cur_head) - released);
     Header *new_head = GET_NEXT_HEADER(cur_head);
-    size_t new_blk_size = old_size - adjusted_size;
-    SET_HEADER(new_head, new_blk_size + 1); //set as free
-
-    if (cur_head == end) {
-        end = new_head;
-    }
-    nused += old_size;
-    if (!base) {
-        base = new_head;
-        start = GET_LISTPOINTERS(base);
-        start->next = NULL;
-        start->prev = NULL;
-        SET_UNUSED(new_head);
-    } else{
-        myfree(GET_MEMORY(new_head));
-    }
-}
-
-// coalesces a block and its right block. Deals with cases of
-// merging used block with free block and when both  blocks are free
-// (ie repeated merging) 
-void merge(ListPointers *lp_cur, ListPointers *lp_next) {
-    Header *cur_h = GET_HEADER(lp_cur);
-    Header *next_h = GET_HEADER(lp_next);
-    Header *old_base = base;
-    bool cur_is_allocated = GET_USED(cur_h);
-    
-    // Cases for merging blocks when both already freed
-    // 1) FE: left block is base/front, right block is end
-    // 2) EF: left = end; right = front/base
-    // 3) MM: both nodes are middle of linked list
-    // 4) FM: left = base/first, right = middle
-    // 5) EM: left = end, right = middle
-    // 6) MF: left = middle, right = front/base
-    // cases not mutually exclusive to account for if next_h is base and end
-    
-    if(next_h == base) { // case 2, 6
-        base_merging(lp_cur, lp_next, cur_is_allocated);
-    }
-
-    if(next_h == end) { // case 1
-        end_merging(lp_cur, lp_next, old_base);
-    }
-
-    if(lp_next->prev && lp_next->next) { // next block is middle of linked list
-        // case 3, 4, 5
-        middle_merging(lp_cur, lp_next, cur_is_allocated);
-    }
- 
-    // update block size headers and pointers
-    size_t new_header = GET_SIZE(cur_h) + GET(next_h);
-    SET_HEADER(cur_h, new_header);
-    SET_HEADER(next_h, 0);
-    SET_UNUSED(cur_h); 
-    lp_next->next = NULL;
-    lp_next->prev = NULL;
-}
-
-// function that deals with merging when the next block is in the middle
-// of linked list (case 3, 4, 5 mentioned in merge)
-void middle_merging(ListPointers *cur_lp, ListPointers *next_lp, bool cur_allocated) {
-    Header *cur_head = GET_HEADER(cur_lp);
-    ListPointers *lp_before_cur;
-    ListPointers *lp_before_next = GET_LISTPOINTERS(next_lp->prev);
-    ListPointers *lp_after_next = GET_LISTPOINTERS(next_lp->next);
-                                          
-    if(!cur_allocated && cur_head != end) { // case 3, 4 
-        lp_before_next->next = next_lp->next;
-        lp_after_next->prev = next_lp->prev;
+    SET_HEADER(new_head, (old_size - adjusted_size) | released);
+    release_block(a, new_head);
+}
+
+// coalesces a block and its free right block. The right block is
+// taken off its list, or if it is end the merged block becomes end.
+// The status bits of the left block are kept so realloc can grow
+// a block that is in use
+void merge(Arena *a, Header *cur_head, Header *next_head) {
+    if (next_head == a->end) {
+        a->end = cur_head;
     } else {
-        if (!cur_allocated) { // case 5
-            lp_before_cur = GET_LISTPOINTERS(cur_lp->prev);
-            lp_before_cur->next = NULL;
-        } 
-        cur_lp->prev = next_lp->prev;
-        cur_lp->next = next_lp->next;
-        if(cur_allocated) { // first merge (in realloc or free)
-            lp_before_next->next = cur_head;
-            lp_after_next->prev = cur_head;
-        }
+        remove_from_list(a, next_head);
+    }
+    SET_HEADER(cur_head, (GET_SIZE(cur_head) + GET_SIZE(next_head)) | GET_FLAGS(cur_head));
+    if (GET_USED(cur_head)) { // block after the merged one now follows a used block
+        CLEAR_PREV_FREE(GET_NEXT_HEADER(cur_head));
     }
 }
 
-// function that deals with merging when next block is the base of linked list
-// house-keeping of pointers depending on case
-void base_merging(ListPointers *lp_cur, ListPointers *lp_next, bool cur_allocated) {
-    Header *next_head = GET_HEADER(lp_next);
-    Header *cur_head = GET_HEADER(lp_cur);
-    ListPointers *lp_before_cur = GET_LISTPOINTERS(lp_cur->prev);
-    
-    if (!cur_allocated) { //bit = 0 ie used; merging 2 freed blocks; case 2, 6
-        lp_before_cur->next = lp_cur->next;
-        ListPointers *lp_after_cur = GET_LISTPOINTERS(lp_cur->next);
-        lp_after_cur->prev = lp_cur->prev;
-    }
-    if (cur_allocated && next_head != end) {
-        ListPointers *lp_after_next = GET_LISTPOINTERS(lp_next->next);
-        lp_after_next->prev = cur_head;
-    }
-    // update pointers and global variables
-    lp_cur->next = lp_next->next;
-    lp_cur->prev = lp_next->prev; //ie NULL
-    base = cur_head;
-    start = GET_LISTPOINTERS(base);
-}
-
-// function that deals with merging when next block is end of linked list
-// (merging with remaining heap seg); house-keeping of pointers depending on case
-void end_merging(ListPointers *lp_cur, ListPointers *lp_next, Header *old_base) {
-    ListPointers *lp_before_next = GET_LISTPOINTERS(lp_next->prev);
-    Header *cur_head = GET_HEADER(lp_cur);
-    Header *next_head = GET_HEADER(lp_next);
-    
-    if(!GET_USED(cur_head)) { // case 1
-        lp_before_next->next = NULL;
-    } else { // first merge; if right block is only node in list, will enter here too
-        lp_cur->next = lp_next->next;
-        lp_cur->prev = lp_next->prev;
-        if (next_head != old_base) {
-            lp_before_next->next = cur_head;
+/* Quick lists
+ * -----------
+ * Built with -DQUICK_MAX_SIZE=n, a freed block of up to n bytes is not
+ * coalesced but parked: it stays marked used in the heap, so neither
+ * neighbour merges with it, and goes on the arena's quick list for its
+ * exact size. A request of that size pops it straight back, skipping the
+ * merge on free and the split on malloc that a program freeing and
+ * allocating the same sizes over and over would otherwise pay each time.
+ * Parked blocks are coalesced all at once by a sweep, which runs when a
+ * quick list grows past QUICK_LIMIT blocks or a request finds no free
+ * block and would have to take from end; each parked block is swept at
+ * most once, so the sweeps cost O(1) per free.
+ */
+
+// parks a used block (its payload already off nused) on its quick list
+void park_block(Arena *a, Header *head) {
+    size_t bin = GET_SIZE(head) / BLOCK_ALIGN;
+    SET_OWNER(head, 0); // a thread cache may have held it
+    SET_LIST_NEXT(head, a->quick[bin]);
+    a->quick[bin] = head;
+    a->quick_map[bin / 64] |= 1UL << (bin % 64);
+    a->parked += GET_SIZE(head) - HEADER_SIZE;
+    if (++a->quick_counts[bin] > QUICK_LIMIT) {
+        sweep_quick_lists(a);
+    }
+}
+
+// hands out the front block of a non-empty quick list
+void *quick_take(Arena *a, size_t bin) {
+    Header *head = a->quick[bin];
+    CHECK_HEADER(head); // its link came from a block the program freed
+    a->quick[bin] = LIST_NEXT(head);
+    if (--a->quick_counts[bin] == 0) {
+        a->quick_map[bin / 64] &= ~(1UL << (bin % 64));
+    }
+    a->parked -= GET_SIZE(head) - HEADER_SIZE;
+    a->nused += GET_SIZE(head) - HEADER_SIZE;
+    return GET_MEMORY(head);
+}
+
+// releases every parked block, coalescing each with whatever is free
+// around it by then
+void sweep_quick_lists(Arena *a) {
+    for (int word = 0; word < QUICK_MAP_WORDS; word++) {
+        while (a->quick_map[word]) {
+            size_t bin = word * 64 + __builtin_ctzl(a->quick_map[word]);
+            Header *head = a->quick[bin];
+            while (head) {
+                Header *next = LIST_NEXT(head);
+                release_block(a, head);
+                head = next;
+            }
+            a->quick[bin] = NULL;
+            a->quick_counts[bin] = 0;
+            a->quick_map[word] &= a->quick_map[word] - 1;
         }
     }
+    a->parked = 0;
 }
-// some functions to trace the heap and check if output  is right
-bool validate_heap() {
-    // print_linked_list();
 
-    // Header *s = segment_start;
-    // if (GET_SIZE(s)) {
-    //  print_heap();
-    // }
+/* Slabs
+ * -----
+ * A slab is a heap block of exactly SLAB_SIZE bytes whose payload starts on
+ * a page boundary, so consecutive slabs carved from end tile the heap with
+ * no slack. The payload holds a Slab header followed by equal-sized objects
+ * with no header of their own; a bitmap in the Slab tracks free slots. The
+ * slab of an object is found by masking its address, and page_map records
+ * which pages hold slabs so myfree can tell slab objects from blocks.
+ *
+ * Slabs with free slots sit on a per-class partial list: the arena's for
+ * slabs nobody owns, or (thread-safe build) the owning thread cache's.
+ * A slab that empties is handed back to the heap unless it is the only
+ * slab left on its list.
+ */
 
-    // printf("\n\n\n");
-    //breakpoint();
-    if (!check_alignment()) {
+// index of the segment page holding ptr, counted in whole pages
+#define PAGE_INDEX(ptr) ((size_t)(ptr) / SLAB_SIZE - (size_t)segment_start / SLAB_SIZE)
+
+// a page's bit only changes while nothing points into it, so a relaxed
+// read of its word (which other slabs' bits share) is enough
+bool is_slab_object(void *ptr) {
+    if (SLAB_MAX_SIZE == 0) {
         return false;
     }
-    if (!check_heap_size()) {
-        return false;
+    size_t page = PAGE_INDEX(ptr);
+    size_t word = __atomic_load_n(&page_map[page / 64], __ATOMIC_RELAXED);
+    return (word >> (page % 64)) & 1;
+}
+
+Slab *slab_of(void *ptr) {
+    return (Slab *)((size_t)ptr & ~(size_t)(SLAB_SIZE - 1));
+}
+
+// first object slot of a slab, just past its Slab header
+#define SLAB_OBJECTS(s) ((char *)(s) + roundup(sizeof(Slab), BLOCK_ALIGN))
+
+// carves a new slab for a size class out of the arena (lock held in the
+// thread-safe build). Returns NULL if the arena is full
+Slab *new_slab(Arena *a, int cls, size_t owner) {
+    Slab *slab = heap_memalign(a, SLAB_SIZE, SLAB_SIZE - HEADER_SIZE);
+    if (!slab) {
+        return NULL;
     }
+    size_t page = PAGE_INDEX(slab);
+    __atomic_fetch_or(&page_map[page / 64], 1UL << (page % 64), __ATOMIC_RELAXED);
     
-    return true;
+    slab->obj_size = slab_sizes[cls];
+    slab->obj_recip = ((1UL << 32) + slab->obj_size - 1) / slab->obj_size;
+    slab->nobjs = (SLAB_SIZE - HEADER_SIZE - (SLAB_OBJECTS(slab) - (char *)slab)) / slab->obj_size;
+    slab->nfree = slab->nobjs;
+    slab->size_class = cls;
+    slab->owner = owner;
+    slab->prev = slab->next = NULL;
+    memset(slab->free_map, 0, sizeof(slab->free_map));
+    for (int i = 0; i < slab->nobjs; i++) {
+        slab->free_map[i / 64] |= 1UL << (i % 64);
+    }
+    return slab;
 }
 
-// checks the alignment  of all of the blocks on the heap
-// return true if aligned, false otherwise
-bool check_alignment() {
-    Header *cur = top;
-    if (cur != end) {
-        while (cur != GET_NEXT_HEADER(end)) {
-            if (((unsigned long)cur & 7) != 0) {
-                return false;
-            }
-            cur = GET_NEXT_HEADER(cur);
+// gives an empty slab's block back to its arena (lock held)
+void release_slab(Arena *a, Slab *slab) {
+    size_t page = PAGE_INDEX(slab);
+    __atomic_fetch_and(&page_map[page / 64], ~(1UL << (page % 64)), __ATOMIC_RELAXED);
+    heap_free(a, slab);
+}
+
+void slab_link(Slab **list, Slab *slab) {
+    slab->prev = NULL;
+    slab->next = *list;
+    if (*list) {
+        (*list)->prev = slab;
+    }
+    *list = slab;
+}
+
+void slab_unlink(Slab **list, Slab *slab) {
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        *list = slab->next;
+    }
+    if (slab->next) {
+        slab->next->prev = slab->prev;
+    }
+}
+
+// takes a free object from the first slab on the class's partial list, or
+// returns NULL if the list is empty. A slab that fills up moves to the
+// full list (if the caller keeps one)
+void *slab_take(Slab **partial, Slab **full, int cls) {
+    Slab *slab = partial[cls];
+    if (!slab) {
+        return NULL;
+    }
+    int word = 0;
+    while (!slab->free_map[word]) {
+        word++;
+    }
+    int bit = __builtin_ctzl(slab->free_map[word]);
+    slab->free_map[word] &= ~(1UL << bit);
+    if (--slab->nfree == 0) {
+        slab_unlink(&partial[cls], slab);
+        if (full) {
+            slab_link(full, slab);
         }
     }
-    return true;
+    return SLAB_OBJECTS(slab) + (word * 64 + bit) * slab->obj_size;
+}
 
+// returns an object to its slab, putting a previously full slab back on
+// the partial list. Returns true if the slab is now empty and is not the
+// last one on its list; the caller then unlinks and releases it
+bool slab_put(Slab **partial, Slab **full, Slab *slab, void *ptr) {
+    // exact for offsets below SLAB_SIZE since offset * obj_size < 2^32
+    int slot = ((size_t)((char *)ptr - SLAB_OBJECTS(slab)) * slab->obj_recip) >> 32;
+    slab->free_map[slot / 64] |= 1UL << (slot % 64);
+    if (slab->nfree++ == 0) {
+        if (full) {
+            slab_unlink(full, slab);
+        }
+        slab_link(&partial[slab->size_class], slab);
+    }
+    if (slab->nfree == slab->nobjs && (slab->prev || slab->next)) {
+        slab_unlink(&partial[slab->size_class], slab);
+        return true;
+    }
+    return false;
 }
 
-// checks that all the blocks add up to the heap segment that
-// was initialized; false if not
-bool check_heap_size() {
-    Header *cur = top;
-    size_t sum_size = 0;
-    
-    while (cur != GET_NEXT_HEADER(end)) {
-        sum_size += GET_SIZE(cur);
-        cur = GET_NEXT_HEADER(cur);
+// realloc of a slab object: stays put if the new size fits the object,
+// otherwise moves to a fresh allocation
+void *slab_realloc(void *old_ptr, size_t new_size) {
+    if (new_size == 0) {
+        route_free(old_ptr);
+        return NULL;
     }
-    return (sum_size == segment_size);
+    if (new_size <= slab_of(old_ptr)->obj_size) {
+        return old_ptr;
+    }
+    return move_block(old_ptr, new_size);
 }
 
-// prints header address and header info (ie total size and
-// allocation) of each free block starting at base
-void print_linked_list() {
-    printf("linked list: \n");
-    Header *cur = base;
-    if (cur && cur != (Header*)((char*)top + segment_size)) {
-        while ((GET_LISTPOINTERS(cur))->next) {
-            printf("Header Address: %p   ; Header: %lu\n", cur, GET(cur));
-            cur = (GET_LISTPOINTERS(cur))->next; //header
+// allocates an object from the arena's shared slabs (arena lock held),
+// starting a new slab when none has room. Returns NULL if the arena is full
+void *slab_malloc(Arena *a, int cls) {
+    void *obj = slab_take(a->slabs, NULL, cls);
+    if (!obj) {
+        Slab *slab = new_slab(a, cls, 0);
+        if (slab) {
+            slab_link(&a->slabs[cls], slab);
+            obj = slab_take(a->slabs, NULL, cls);
+        }
+    }
+    return obj;
+}
+
+/* Mapped blocks
+ * -------------
+ * A request of MMAP_THRESHOLD bytes or more gets a mapping of its own
+ * rather than a block of the heap, so a huge buffer never leaves a hole
+ * for small requests to split and is returned to the OS as soon as it is
+ * freed. The mapping's length is kept in the word before the block's
+ * header, and any pointer outside the heap is a mapped block. Growing or
+ * shrinking one uses mremap, which moves page table entries instead of
+ * copying. A block shrunk below the threshold moves back to the heap.
+ * Requests over MAX_REQUEST_SIZE, which the heap never serves, are
+ * always mapped, threshold or not, up to the largest size a header can
+ * hold; past that it is up to the OS whether the mapping succeeds.
+ */
+#define MMAP_PREFIX (BLOCK_ALIGN > 16 ? BLOCK_ALIGN : 16) // mapping length, then the header
+#define MAX_MAPPED_SIZE ((size_t)SIZE_MASK - MMAP_PREFIX - PAGE_SIZE) // fits the header once rounded up
+#if MMAP_THRESHOLD == 0
+#define WANTS_MAPPING(size) ((size) > MAX_REQUEST_SIZE)
+#elif MMAP_THRESHOLD > MAX_REQUEST_SIZE
+#error "MMAP_THRESHOLD must not exceed MAX_REQUEST_SIZE"
+#else
+#define WANTS_MAPPING(size) ((size) >= MMAP_THRESHOLD)
+#endif
+#define SORT_CUTOFF 64 // longer batches are sorted with qsort
+
+// usable bytes of an allocated block, slab object or mapped block
+size_t payload_size(void *ptr) {
+    if (is_mapped(ptr)) {
+        // the rest of the mapping, which a 4-byte header can't hold exactly
+        return *(size_t *)((char *)ptr - MMAP_PREFIX) - MMAP_PREFIX;
+    }
+    if (is_slab_object(ptr)) {
+        return slab_of(ptr)->obj_size;
+    }
+    Header *head = GET_HEADER(ptr);
+    return GET_SIZE(head) - HEADER_SIZE;
+}
+
+// realloc by allocating new_size elsewhere, copying and freeing old_ptr.
+// Returns NULL, leaving old_ptr alone, if the allocation fails
+void *move_block(void *old_ptr, size_t new_size) {
+    size_t old_size = payload_size(old_ptr);
+    void *new_ptr = route_malloc(new_size);
+    if (new_ptr) {
+        memcpy(new_ptr, old_ptr, (old_size < new_size) ? old_size : new_size);
+        route_free(old_ptr);
+    }
+    return new_ptr;
+}
+
+bool is_mapped(void *ptr) {
+    return (char *)ptr < (char *)segment_start ||
+           (char *)ptr >= (char *)segment_start + segment_size;
+}
+
+// maps a block for the request, or returns NULL if the OS refuses
+void *mmap_malloc(size_t requested_size) {
+    if (requested_size > MAX_MAPPED_SIZE) {
+        return NULL;
+    }
+    size_t len = roundup(requested_size + MMAP_PREFIX, PAGE_SIZE);
+    char *base = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        return NULL;
+    }
+    *(size_t *)base = len;
+    Header *head = (Header *)(base + MMAP_PREFIX) - 1;
+    SET_HEADER(head, (len - MMAP_PREFIX + HEADER_SIZE) | 1); // the rest of the mapping, used
+    return GET_MEMORY(head);
+}
+
+void mmap_free(void *ptr) {
+    char *base = (char *)ptr - MMAP_PREFIX;
+    munmap(base, *(size_t *)base);
+}
+
+// resizes a mapped block in place or by remapping it, moving it back to
+// the heap if it no longer wants a mapping
+void *mmap_realloc(void *old_ptr, size_t new_size) {
+    if (new_size == 0) {
+        mmap_free(old_ptr);
+        return NULL;
+    }
+    if (!WANTS_MAPPING(new_size) || new_size > MAX_MAPPED_SIZE) {
+        return (new_size > MAX_MAPPED_SIZE) ? NULL : move_block(old_ptr, new_size);
+    }
+    char *base = (char *)old_ptr - MMAP_PREFIX;
+    size_t old_len = *(size_t *)base;
+    size_t len = roundup(new_size + MMAP_PREFIX, PAGE_SIZE);
+    if (len != old_len) {
+        base = mremap(base, old_len, len, MREMAP_MAYMOVE);
+        if (base == MAP_FAILED) {
+            return NULL;
+        }
+        *(size_t *)base = len;
+        Header *head = (Header *)(base + MMAP_PREFIX) - 1;
+        SET_HEADER(head, (len - MMAP_PREFIX + HEADER_SIZE) | 1);
+    }
+    return base + MMAP_PREFIX;
+}
+
+/* Hardening
+ * ---------
+ * Built with -DHARDENED, the top 16 bits of every header hold a canary:
+ * a hash of the heap's secret, the header's address and the block size,
+ * set by SET_HEADER and checked wherever the heap trusts a header it did
+ * not just write: the block being freed or reallocated, both its
+ * neighbours, and each block taken off a free list. Free list links are
+ * stored XORed with the secret, so a link overwritten by anyone who
+ * doesn't know it decodes to an address outside the arena. Each block's
+ * payload ends in a guard word, also keyed by the secret and the block's
+ * address, which the public functions write on allocation, check before
+ * a free or realloc, and invert on free. A smashed guard means an overflow; an inverted one, or
+ * a header no longer marked used, means a double free. Any of these
+ * aborts the program.
+ *
+ * The heap cannot tell a double free of a block still sitting in a
+ * thread cache or slab from a first one except by its guard, so a block
+ * whose guard was overwritten in between passes as an overflow.
+ */
+
+// usable bytes of a block, not counting the guard word
+size_t usable_size(void *ptr) {
+    return payload_size(ptr) - REDZONE_SIZE;
+}
+
+#ifdef HARDENED
+// h could be the header of a free block of arena a
+#define IN_ARENA(a, h) ((char *)(h) >= (char *)(a)->top && (h) < (a)->end && \
+                        ((uintptr_t)(h) + HEADER_SIZE) % BLOCK_ALIGN == 0)
+
+// 16-bit canary of a header holding size at this address
+size_t canary_of(Header *head, size_t size) {
+    return ((heap_secret ^ (uintptr_t)head ^ size) * 0x9E3779B97F4A7C15UL) >> CANARY_SHIFT;
+}
+
+// val with its canary in place of whatever its top bits held
+size_t seal(Header *head, size_t val) {
+    val &= (1UL << CANARY_SHIFT) - 1;
+    return val | (canary_of(head, val & SIZE_MASK) << CANARY_SHIFT);
+}
+
+bool canary_ok(Header *head) {
+    return GET(head) >> CANARY_SHIFT == canary_of(head, GET_SIZE(head));
+}
+
+void check_header(Header *head) {
+    if (!canary_ok(head)) {
+        heap_corrupt("block header overwritten", head);
+    }
+}
+
+// checks a block about to be unlinked: it must be a free block of the
+// arena, and its links must lead to block headers inside the arena. The
+// neighbours themselves aren't read, as the unlink only writes to them
+void check_link(Arena *a, Header *head, Header *prev, Header *next) {
+    if (!IN_ARENA(a, head) || !canary_ok(head) || GET_USED(head)) {
+        heap_corrupt("free block corrupted", head);
+    }
+    if ((prev && !IN_ARENA(a, prev)) || (next && !IN_ARENA(a, next))) {
+        heap_corrupt("free list link corrupted", head);
+    }
+}
+
+// checks a block passed to myfree or myrealloc: its header if it has
+// one, then the guard word after its size usable bytes
+void check_block(void *ptr, size_t size) {
+    if (is_mapped(ptr) || !is_slab_object(ptr)) {
+        Header *head = GET_HEADER(ptr);
+        if (!canary_ok(head)) {
+            heap_corrupt("bad pointer or header overwritten", ptr);
+        }
+        if (!GET_USED(head)) {
+            heap_corrupt("double free", ptr);
+        }
+    }
+    size_t guard = *(size_t *)((char *)ptr + size);
+    if (guard != GUARD_VALUE(ptr)) {
+        heap_corrupt((guard == ~GUARD_VALUE(ptr)) ? "double free" : "write past end of block", ptr);
+    }
+}
+
+// reports corruption the hardened heap ran into and aborts: carrying on
+// would let an attacker steer the next allocation
+void heap_corrupt(const char *msg, void *where) {
+    fprintf(stderr, "heap corruption: %s at %p\n", msg, where);
+    abort();
+}
+#endif
+
+// true for a block of the heap proper: not mapped, not a slab object and
+// not owned by a thread cache
+bool is_plain_block(void *ptr) {
+    if (ptr == NULL || is_mapped(ptr) || is_slab_object(ptr)) {
+        return false;
+    }
+    Header *head = GET_HEADER(ptr);
+    return GET_OWNER(head) == 0;
+}
+
+int compare_ptrs(const void *a, const void *b) {
+    char *x = *(char * const *)a, *y = *(char * const *)b;
+    return (x > y) - (x < y);
+}
+
+// sorts ptrs by address: insertion sort for the short batches callers
+// mostly pass, where qsort's calls through compare_ptrs dominate
+void sort_ptrs(void **ptrs, size_t n) {
+    if (n > SORT_CUTOFF) {
+        qsort(ptrs, n, sizeof(void *), compare_ptrs);
+        return;
+    }
+    for (size_t i = 1; i < n; i++) {
+        void *ptr = ptrs[i];
+        size_t j = i;
+        for (; j > 0 && (char *)ptrs[j - 1] > (char *)ptr; j--) {
+            ptrs[j] = ptrs[j - 1];
+        }
+        ptrs[j] = ptr;
+    }
+}
+
+#ifndef THREAD_SAFE
+
+void *route_malloc(size_t requested_size) {
+    Arena *a = &arenas[0];
+    if (WANTS_MAPPING(requested_size)) {
+        void *block = mmap_malloc(requested_size);
+        if (block) {
+            return block;
+        }
+    }
+#if SLAB_MAX_SIZE > 0
+    if (requested_size > 0 && requested_size <= SLAB_MAX_SIZE) {
+        void *obj = slab_malloc(a, slab_class_of[roundup(requested_size, ALIGNMENT) / 8]);
+        if (obj) {
+            return obj;
+        }
+    }
+#endif
+    return heap_malloc(a, requested_size);
+}
+
+// like route_malloc, but the block reads as zeros: a mapping is fresh
+// from the OS, and the heap clears only what it can't vouch for
+void *route_calloc(size_t requested_size) {
+    if (requested_size > SLAB_MAX_SIZE && !WANTS_MAPPING(requested_size)) {
+        return heap_calloc(&arenas[0], requested_size);
+    }
+    void *block = route_malloc(requested_size);
+    if (block && !is_mapped(block)) {
+        memset(block, 0, requested_size);
+    }
+    return block;
+}
+
+void route_free(void *ptr) {
+    if (ptr && is_mapped(ptr)) {
+        mmap_free(ptr);
+        return;
+    }
+    if (ptr && is_slab_object(ptr)) {
+        Slab *slab = slab_of(ptr);
+        if (slab_put(arenas[0].slabs, NULL, slab, ptr)) {
+            release_slab(&arenas[0], slab);
+        }
+        return;
+    }
+    heap_free(&arenas[0], ptr);
+}
+
+void *route_realloc(void *old_ptr, size_t new_size) {
+    if (old_ptr && is_mapped(old_ptr)) {
+        return mmap_realloc(old_ptr, new_size);
+    }
+    if (old_ptr && WANTS_MAPPING(new_size) && new_size <= MAX_MAPPED_SIZE) {
+        return move_block(old_ptr, new_size); // grows by mremap from now on
+    }
+    if (old_ptr && is_slab_object(old_ptr)) {
+        return slab_realloc(old_ptr, new_size);
+    }
+    return heap_realloc(&arenas[0], old_ptr, new_size);
+}
+
+// aligned blocks always come from the heap
+void *route_memalign(size_t align, size_t requested_size) {
+    return heap_memalign(&arenas[0], align, requested_size);
+}
+
+// heap blocks are carved in runs; slab objects and mapped blocks are
+// allocated one at a time
+size_t route_malloc_batch(size_t requested_size, size_t n, void **out) {
+    size_t count = 0;
+    if (requested_size > SLAB_MAX_SIZE && !WANTS_MAPPING(requested_size)) {
+        count = heap_malloc_batch(&arenas[0], requested_size, n, out);
+    }
+    while (count < n && (out[count] = route_malloc(requested_size)) != NULL) {
+        count++;
+    }
+    return count;
+}
+
+void route_free_batch(void **ptrs, size_t n) {
+    sort_ptrs(ptrs, n);
+    for (size_t i = 0; i < n; ) {
+        if (is_plain_block(ptrs[i])) {
+            i = free_run(&arenas[0], ptrs, i, n);
+        } else {
+            route_free(ptrs[i++]);
+        }
+    }
+}
+
+#else
+
+/* Thread caches
+ * -------------
+ * Each arena is guarded by its own lock, and threads are assigned to
+ * arenas round-robin as they first allocate; a block is always returned
+ * to the arena whose slice holds it. In front of the arenas each
+ * thread owns a ThreadCache with:
+ *   - its own slabs, which only the owner allocates from or frees into,
+ *     so slab objects need no lock at all
+ *   - one LIFO bin per block size up to TCACHE_MAX_SIZE, linked through
+ *     the first word of the payload. Cached blocks stay marked used in
+ *     the heap and carry their cache's id in the owner bits of the header.
+ *     A miss refills the bin with TCACHE_FILL blocks from the thread's
+ *     arena under a single lock hold, and a bin over TCACHE_LIMIT flushes
+ *     half of itself back in one go.
+ *
+ * A thread freeing an object owned by another cache (the slab's owner or
+ * the block's owner bits) queues it in a RemoteBatch and hands
+ * REMOTE_BATCH objects at a time to the owner's inbox; the owner drains
+ * its inbox on its next miss. When a thread exits its slabs are orphaned
+ * to their arena, and anything still sent to it goes straight back to
+ * the heap. Threads beyond MAX_THREADS run without a cache and use the
+ * arenas' shared slabs under the arena lock.
+ *
+ * Remote frees take no lock. An inbox is a stack that any thread pushes
+ * a whole batch onto with one compare-and-swap and only its owner
+ * empties, by swapping in NULL, so there is no ABA problem. The inbox of
+ * a cache nobody holds is INBOX_CLOSED, and batches for it go to the
+ * heap. A free that falls through to the heap only tries the arena's
+ * lock: if another thread holds it, the object is pushed onto the
+ * arena's remote_frees the same way, and the next thread to take the
+ * lock to allocate, resize or free (lock_arena) frees the whole list
+ * first. Until then the objects count as used.
+ */
+
+#define MAX_THREADS 255 // owner ids 1..MAX_THREADS fit the owner bits
+#ifndef TCACHE_MAX_SIZE
+#define TCACHE_MAX_SIZE 1024 // largest cached block, header included
+#endif
+#define TCACHE_BINS (TCACHE_MAX_SIZE / BLOCK_ALIGN + 1)
+#define TCACHE_FILL 16 // blocks fetched per trip to the heap
+#define TCACHE_LIMIT 64 // blocks a bin holds before it is flushed
+#define REMOTE_SLOTS 4 // owners a thread batches remote frees for at once
+#define REMOTE_BATCH 32 // remote frees sent to an owner together
+#define OBJ_NEXT(p) (*(void **)(p)) // link of a cached or queued object
+#define INBOX_CLOSED ((void *)1) // inbox of a cache no thread holds
+
+typedef struct remote_batch {
+    size_t owner; // 0 if the slot is unused
+    void *head;
+    void *tail;
+    int count;
+} RemoteBatch;
+
+typedef struct thread_cache {
+    void *bins[TCACHE_BINS];
+    int counts[TCACHE_BINS];
+    Slab *slabs[SLAB_CLASSES]; // owned slabs with free slots
+    Slab *full_slabs; // owned slabs with none
+    RemoteBatch remote[REMOTE_SLOTS];
+    void *inbox; // objects freed by other threads, or INBOX_CLOSED
+    bool alive; // guarded by registry_lock
+    OpStats stats; // calls made by the threads that held the slot
+} ThreadCache;
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER; // guards shared_stats, peak_bytes
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t cache_key; // runs release_thread_cache at thread exit
+static pthread_key_t arena_key; // runs leave_arena at thread exit
+static ThreadCache caches[MAX_THREADS + 1]; // slot 0 unused: owner 0 is "none"
+static int next_arena; // round-robin counter
+static __thread ThreadCache *my_cache;
+static __thread bool no_cache; // registry was full
+static __thread Arena *my_arena;
+
+ThreadCache *get_thread_cache();
+Arena *get_thread_arena();
+void leave_arena(void *arg);
+void *arena_malloc(size_t requested_size);
+void *arena_calloc(size_t requested_size);
+void *arena_memalign(size_t align, size_t requested_size);
+void fork_prepare();
+void fork_parent();
+void fork_child();
+void release_thread_cache(void *arg);
+void orphan_slab(Slab *slab);
+void flush_bin(ThreadCache *tc, size_t bin, int count);
+void drain_inbox(ThreadCache *tc);
+void send_remote_batch(RemoteBatch *rb);
+bool push_objects(void **stack, void *head, void *tail);
+void lock_arena(Arena *a);
+void drain_remote_frees(Arena *a);
+void free_to_arena(Arena *a, void *obj);
+void queue_remote_free(ThreadCache *tc, void *ptr, size_t owner);
+void free_object_list(void *list);
+void local_slab_free(ThreadCache *tc, void *ptr);
+
+void make_cache_key() {
+    pthread_key_create(&cache_key, release_thread_cache);
+    pthread_key_create(&arena_key, leave_arena);
+    pthread_atfork(fork_prepare, fork_parent, fork_child);
+}
+
+// returns the calling thread's arena, assigning the next one round-robin
+// on first use
+Arena *get_thread_arena() {
+    if (!my_arena) {
+        pthread_once(&cache_key_once, make_cache_key);
+        int index = __atomic_fetch_add(&next_arena, 1, __ATOMIC_RELAXED) % num_arenas;
+        my_arena = &arenas[index];
+        __atomic_add_fetch(&my_arena->nthreads, 1, __ATOMIC_RELAXED);
+        pthread_setspecific(arena_key, my_arena);
+    }
+    return my_arena;
+}
+
+void leave_arena(void *arg) {
+    Arena *a = arg;
+    __atomic_sub_fetch(&a->nthreads, 1, __ATOMIC_RELAXED);
+    my_arena = NULL;
+}
+
+// allocates a block from the thread's arena, trying the others in turn
+// when its slice is full. Alignments above ALIGNMENT use heap_memalign
+void *arena_memalign(size_t align, size_t requested_size) {
+    Arena *home = get_thread_arena();
+    Arena *a = home;
+    void *block;
+    
+    do {
+        lock_arena(a);
+        if (align > ALIGNMENT) {
+            block = heap_memalign(a, align, requested_size);
+        } else {
+            block = heap_malloc(a, requested_size);
+        }
+        pthread_mutex_unlock(&a->lock);
+        if (++a == arenas + num_arenas) {
+            a = arenas;
+        }
+    } while (!block && a != home);
+    return block;
+}
+
+void *arena_malloc(size_t requested_size) {
+    return arena_memalign(ALIGNMENT, requested_size);
+}
+
+// like arena_malloc, but the block reads as zeros
+void *arena_calloc(size_t requested_size) {
+    Arena *home = get_thread_arena();
+    Arena *a = home;
+    void *block;
+    
+    do {
+        lock_arena(a);
+        block = heap_calloc(a, requested_size);
+        pthread_mutex_unlock(&a->lock);
+        if (++a == arenas + num_arenas) {
+            a = arenas;
+        }
+    } while (!block && a != home);
+    return block;
+}
+
+// a forked child has only the thread that called fork, so no lock may be
+// held across it: take them all beforehand, in the order they nest
+// (the profile's first, as a dump allocates under it), and drop them on
+// both sides. Caches of the parent's other threads stay claimed in the
+// child, along with whatever they had in flight
+void fork_prepare() {
+#if PROFILE_RATE > 0
+    pthread_mutex_lock(&profile_lock);
+#endif
+    pthread_mutex_lock(&registry_lock);
+    pthread_mutex_lock(&stats_lock);
+    for (int i = 0; i < num_arenas; i++) {
+        pthread_mutex_lock(&arenas[i].lock);
+    }
+}
+
+void fork_parent() {
+    for (int i = num_arenas - 1; i >= 0; i--) {
+        pthread_mutex_unlock(&arenas[i].lock);
+    }
+    pthread_mutex_unlock(&stats_lock);
+    pthread_mutex_unlock(&registry_lock);
+#if PROFILE_RATE > 0
+    pthread_mutex_unlock(&profile_lock);
+#endif
+}
+
+void fork_child() {
+    fork_parent();
+}
+
+// returns the calling thread's cache, claiming a free slot on first
+// use, or NULL if every slot is taken
+ThreadCache *get_thread_cache() {
+    if (my_cache || no_cache) {
+        return my_cache;
+    }
+    pthread_once(&cache_key_once, make_cache_key);
+    pthread_mutex_lock(&registry_lock);
+    for (int i = 1; i <= MAX_THREADS && !my_cache; i++) {
+        if (!caches[i].alive) {
+            caches[i].alive = true;
+            __atomic_store_n(&caches[i].inbox, NULL, __ATOMIC_RELAXED); // open it
+            my_cache = &caches[i];
+        }
+    }
+    pthread_mutex_unlock(&registry_lock);
+    if (my_cache) {
+        pthread_setspecific(cache_key, my_cache);
+    } else {
+        no_cache = true;
+    }
+    return my_cache;
+}
+
+// thread exit: everything the cache holds or has queued goes back to
+// the heap, its slabs are handed to their arenas and the slot is given
+// up for reuse. Closing the inbox sends later batches to the heap
+void release_thread_cache(void *arg) {
+    ThreadCache *tc = arg;
+    for (int i = 0; i < REMOTE_SLOTS; i++) {
+        send_remote_batch(&tc->remote[i]);
+    }
+    for (size_t bin = 0; bin < TCACHE_BINS; bin++) {
+        flush_bin(tc, bin, tc->counts[bin]);
+    }
+    for (int cls = 0; cls < SLAB_CLASSES; cls++) {
+        while (tc->slabs[cls]) {
+            Slab *slab = tc->slabs[cls];
+            slab_unlink(&tc->slabs[cls], slab);
+            orphan_slab(slab);
+        }
+    }
+    while (tc->full_slabs) {
+        Slab *slab = tc->full_slabs;
+        slab_unlink(&tc->full_slabs, slab);
+        orphan_slab(slab);
+    }
+    free_object_list(__atomic_exchange_n(&tc->inbox, INBOX_CLOSED, __ATOMIC_ACQUIRE));
+    pthread_mutex_lock(&registry_lock);
+    tc->alive = false;
+    pthread_mutex_unlock(&registry_lock);
+    my_cache = NULL;
+}
+
+// gives an exiting thread's slab to its arena: from now on it is freed
+// into under the arena lock, and allocated from by threads with no cache
+void orphan_slab(Slab *slab) {
+    Arena *a = arena_of(slab);
+    pthread_mutex_lock(&a->lock);
+    __atomic_store_n(&slab->owner, 0, __ATOMIC_RELAXED);
+    if (slab->nfree == slab->nobjs) {
+        release_slab(a, slab);
+    } else if (slab->nfree > 0) {
+        slab_link(&a->slabs[slab->size_class], slab);
+    }
+    pthread_mutex_unlock(&a->lock);
+}
+
+// drops every cached block and owned slab and clears the counters; only
+// called from myinit, which discards the heap they came from
+void reset_thread_caches() {
+    for (int i = 1; i <= MAX_THREADS; i++) {
+        memset(caches[i].bins, 0, sizeof(caches[i].bins));
+        memset(caches[i].counts, 0, sizeof(caches[i].counts));
+        memset(caches[i].slabs, 0, sizeof(caches[i].slabs));
+        memset(caches[i].remote, 0, sizeof(caches[i].remote));
+        memset(&caches[i].stats, 0, sizeof(caches[i].stats));
+        caches[i].full_slabs = NULL;
+        caches[i].inbox = caches[i].alive ? NULL : INBOX_CLOSED;
+    }
+}
+
+// frees an object no live cache owns (a heap block, or an object of a
+// shared or orphaned slab) with the arena's lock held
+void free_to_arena(Arena *a, void *obj) {
+    if (is_slab_object(obj)) {
+        Slab *slab = slab_of(obj);
+        if (slab_put(a->slabs, NULL, slab, obj)) {
+            release_slab(a, slab);
+        }
+    } else {
+        heap_free(a, obj);
+    }
+}
+
+// pushes the list head..tail onto a lock-free stack (an inbox or an
+// arena's remote_frees). Returns false, pushing nothing, if the stack is
+// a closed inbox
+bool push_objects(void **stack, void *head, void *tail) {
+    void *top = __atomic_load_n(stack, __ATOMIC_RELAXED);
+    do {
+        if (top == INBOX_CLOSED) {
+            return false;
+        }
+        OBJ_NEXT(tail) = top;
+    } while (!__atomic_compare_exchange_n(stack, &top, head, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    return true;
+}
+
+// frees the objects other threads pushed while the arena's lock was
+// taken; called with the lock held
+void drain_remote_frees(Arena *a) {
+    if (!__atomic_load_n(&a->remote_frees, __ATOMIC_RELAXED)) {
+        return;
+    }
+    void *list = __atomic_exchange_n(&a->remote_frees, NULL, __ATOMIC_ACQUIRE);
+    while (list) {
+        void *next = OBJ_NEXT(list);
+        free_to_arena(a, list);
+        list = next;
+    }
+}
+
+// takes an arena's lock, then frees what was left for it meanwhile
+void lock_arena(Arena *a) {
+    pthread_mutex_lock(&a->lock);
+    drain_remote_frees(a);
+}
+
+// frees a list of objects (linked through OBJ_NEXT) that no live cache
+// owns to their arenas, holding each arena's lock across runs of its
+// objects
+void free_object_list(void *list) {
+    Arena *locked = NULL;
+    
+    while (list) {
+        void *next = OBJ_NEXT(list);
+        Arena *a = arena_of(list);
+        if (a != locked) {
+            if (locked) {
+                pthread_mutex_unlock(&locked->lock);
+            }
+            lock_arena(a);
+            locked = a;
+        }
+        free_to_arena(a, list);
+        list = next;
+    }
+    if (locked) {
+        pthread_mutex_unlock(&locked->lock);
+    }
+}
+
+// moves count blocks from the front of a bin back to the heap
+void flush_bin(ThreadCache *tc, size_t bin, int count) {
+    if (count == 0) {
+        return;
+    }
+    void *list = tc->bins[bin];
+    void *last = list;
+    for (int i = 1; i < count; i++) {
+        last = OBJ_NEXT(last);
+    }
+    tc->bins[bin] = OBJ_NEXT(last);
+    tc->counts[bin] -= count;
+    OBJ_NEXT(last) = NULL;
+    free_object_list(list);
+}
+
+// returns an object to one of the thread's own slabs, releasing the
+// slab to its arena if that left it empty
+void local_slab_free(ThreadCache *tc, void *ptr) {
+    Slab *slab = slab_of(ptr);
+    if (slab_put(tc->slabs, &tc->full_slabs, slab, ptr)) {
+        Arena *a = arena_of(slab);
+        pthread_mutex_lock(&a->lock);
+        release_slab(a, slab);
+        pthread_mutex_unlock(&a->lock);
+    }
+}
+
+// takes back the objects other threads returned to this cache. Objects
+// of slabs orphaned since they were sent go to the heap instead
+void drain_inbox(ThreadCache *tc) {
+    void *list = __atomic_exchange_n(&tc->inbox, NULL, __ATOMIC_ACQUIRE);
+    
+    void *others = NULL;
+    while (list) {
+        void *next = OBJ_NEXT(list);
+        if (!is_slab_object(list)) {
+            Header *head = GET_HEADER(list); // size read unlocked, as in route_free
+            size_t bin = GET_SIZE(head) / BLOCK_ALIGN;
+            OBJ_NEXT(list) = tc->bins[bin];
+            tc->bins[bin] = list;
+            tc->counts[bin]++;
+        } else if (__atomic_load_n(&slab_of(list)->owner, __ATOMIC_RELAXED) == tc - caches) {
+            local_slab_free(tc, list);
+        } else {
+            OBJ_NEXT(list) = others;
+            others = list;
+        }
+        list = next;
+    }
+    free_object_list(others);
+}
+
+// hands a batch of remote frees to the owner's inbox, or to the heap if
+// the owner has exited, and empties the batch
+void send_remote_batch(RemoteBatch *rb) {
+    if (!rb->owner) {
+        return;
+    }
+    if (!push_objects(&caches[rb->owner].inbox, rb->head, rb->tail)) {
+        OBJ_NEXT(rb->tail) = NULL;
+        free_object_list(rb->head);
+    }
+    memset(rb, 0, sizeof(*rb));
+}
+
+// queues an object owned by another cache, sending the batch once it
+// holds REMOTE_BATCH objects
+void queue_remote_free(ThreadCache *tc, void *ptr, size_t owner) {
+    RemoteBatch *rb = NULL;
+    for (int i = 0; i < REMOTE_SLOTS && !rb; i++) {
+        if (tc->remote[i].owner == owner) {
+            rb = &tc->remote[i];
+        }
+    }
+    if (!rb) { // take an empty slot, evicting the fullest batch if needed
+        rb = &tc->remote[0];
+        for (int i = 0; i < REMOTE_SLOTS; i++) {
+            if (!tc->remote[i].owner) {
+                rb = &tc->remote[i];
+                break;
+            }
+            if (tc->remote[i].count > rb->count) {
+                rb = &tc->remote[i];
+            }
+        }
+        send_remote_batch(rb);
+        rb->owner = owner;
+        rb->tail = ptr;
+    }
+    OBJ_NEXT(ptr) = rb->head;
+    rb->head = ptr;
+    if (++rb->count == REMOTE_BATCH) {
+        send_remote_batch(rb);
+    }
+}
+
+void *route_malloc(size_t requested_size) {
+    ThreadCache *tc = NULL;
+    size_t total_size = adjusted_block_size(requested_size);
+    
+    if (WANTS_MAPPING(requested_size)) {
+        void *block = mmap_malloc(requested_size);
+        if (block) {
+            return block;
+        }
+    }
+    if (requested_size > 0 && total_size <= TCACHE_MAX_SIZE) {
+        tc = get_thread_cache();
+    }
+#if SLAB_MAX_SIZE > 0
+    if (requested_size > 0 && requested_size <= SLAB_MAX_SIZE) {
+        int cls = slab_class_of[roundup(requested_size, ALIGNMENT) / 8];
+        void *obj = NULL;
+        if (!tc) { // shared slabs of the thread's arena
+            Arena *a = get_thread_arena();
+            lock_arena(a);
+            obj = slab_malloc(a, cls);
+            pthread_mutex_unlock(&a->lock);
+            return obj ? obj : arena_malloc(requested_size);
+        }
+        obj = slab_take(tc->slabs, &tc->full_slabs, cls);
+        if (!obj && __atomic_load_n(&tc->inbox, __ATOMIC_RELAXED)) {
+            drain_inbox(tc);
+            obj = slab_take(tc->slabs, &tc->full_slabs, cls);
+        }
+        if (!obj) {
+            Arena *a = get_thread_arena();
+            lock_arena(a);
+            Slab *slab = new_slab(a, cls, tc - caches);
+            pthread_mutex_unlock(&a->lock);
+            if (slab) {
+                slab_link(&tc->slabs[cls], slab);
+                obj = slab_take(tc->slabs, &tc->full_slabs, cls);
+            }
+        }
+        return obj ? obj : arena_malloc(requested_size);
+    }
+#endif
+    if (!tc) {
+        return arena_malloc(requested_size);
+    }
+    
+    size_t bin = total_size / BLOCK_ALIGN;
+    if (!tc->bins[bin] && __atomic_load_n(&tc->inbox, __ATOMIC_RELAXED)) {
+        drain_inbox(tc);
+    }
+    if (!tc->bins[bin]) { // refill from the thread's arena
+        Arena *a = get_thread_arena();
+        lock_arena(a);
+        for (int i = 0; i < TCACHE_FILL; i++) {
+            void *block = heap_malloc(a, requested_size);
+            if (!block) {
+                break;
+            }
+            Header *head = GET_HEADER(block);
+            size_t blk_bin = GET_SIZE(head) / BLOCK_ALIGN; // may be a bit larger
+            if (blk_bin >= TCACHE_BINS) { // too big to cache, try again later
+                heap_free(a, block);
+                break;
+            }
+            SET_OWNER(head, tc - caches);
+            OBJ_NEXT(block) = tc->bins[blk_bin];
+            tc->bins[blk_bin] = block;
+            tc->counts[blk_bin]++;
+        }
+        pthread_mutex_unlock(&a->lock);
+        if (!tc->bins[bin]) { // heap full, or every block came back larger
+            for (size_t b = bin + 1; b < TCACHE_BINS && !tc->bins[bin]; b++) {
+                if (tc->bins[b]) {
+                    bin = b;
+                }
+            }
+            if (!tc->bins[bin]) { // arena full: fall back to the others
+                return arena_malloc(requested_size);
+            }
+        }
+    }
+    void *block = tc->bins[bin];
+    tc->bins[bin] = OBJ_NEXT(block);
+    tc->counts[bin]--;
+    return block;
+}
+
+// blocks too big for the thread cache and slabs come zeroed from the
+// heap; the rest are cleared here
+void *route_calloc(size_t requested_size) {
+    if (requested_size > SLAB_MAX_SIZE && !WANTS_MAPPING(requested_size) &&
+        adjusted_block_size(requested_size) > TCACHE_MAX_SIZE) {
+        return arena_calloc(requested_size);
+    }
+    void *block = route_malloc(requested_size);
+    if (block && !is_mapped(block)) {
+        memset(block, 0, requested_size);
+    }
+    return block;
+}
+
+void route_free(void *ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+    if (is_mapped(ptr)) {
+        mmap_free(ptr);
+        return;
+    }
+    ThreadCache *tc;
+    size_t owner;
+    
+    if (is_slab_object(ptr)) {
+        owner = __atomic_load_n(&slab_of(ptr)->owner, __ATOMIC_RELAXED);
+        tc = owner ? get_thread_cache() : NULL;
+        if (tc && &caches[owner] == tc) {
+            local_slab_free(tc, ptr);
+            return;
+        }
+        if (owner && !tc) { // no cache to batch in: send it on its own
+            RemoteBatch rb = { owner, ptr, ptr, 1 };
+            OBJ_NEXT(ptr) = NULL;
+            send_remote_batch(&rb);
+            return;
+        }
+    } else {
+        Header *head = GET_HEADER(ptr);
+        // read without the arena lock: the heap may flip this header's prev free
+        // bit meanwhile, but the size and owner bits stay put while in use
+        owner = GET_OWNER(head);
+        tc = owner ? get_thread_cache() : NULL;
+        if (GET_SIZE(head) > TCACHE_MAX_SIZE) {
+            tc = NULL;
+        }
+        if (tc && &caches[owner] == tc) {
+            size_t bin = GET_SIZE(head) / BLOCK_ALIGN;
+            OBJ_NEXT(ptr) = tc->bins[bin];
+            tc->bins[bin] = ptr;
+            if (++tc->counts[bin] > TCACHE_LIMIT) {
+                flush_bin(tc, bin, TCACHE_LIMIT / 2);
+            }
+            return;
+        }
+    }
+    if (tc) { // owned by another thread's cache
+        queue_remote_free(tc, ptr, owner);
+        return;
+    }
+    Arena *a = arena_of(ptr);
+    if (pthread_mutex_trylock(&a->lock) != 0) { // busy: leave it to the holder
+        push_objects(&a->remote_frees, ptr, ptr);
+        return;
+    }
+    drain_remote_frees(a);
+    free_to_arena(a, ptr);
+    pthread_mutex_unlock(&a->lock);
+}
+
+// cached blocks are ordinary used blocks to the heap, so realloc works
+// on them directly; a resized block loses its owner and is no longer
+// sent back to a cache. If the block's arena has no room for the new
+// size, the block moves to whichever arena does
+void *route_realloc(void *old_ptr, size_t new_size) {
+    if (old_ptr == NULL) {
+        return route_malloc(new_size);
+    }
+    if (is_mapped(old_ptr)) {
+        return mmap_realloc(old_ptr, new_size);
+    }
+    if (WANTS_MAPPING(new_size) && new_size <= MAX_MAPPED_SIZE) {
+        return move_block(old_ptr, new_size); // grows by mremap from now on
+    }
+    if (is_slab_object(old_ptr)) {
+        return slab_realloc(old_ptr, new_size);
+    }
+    Arena *a = arena_of(old_ptr);
+    Header *old_head = GET_HEADER(old_ptr);
+    lock_arena(a);
+    size_t old_size = GET_SIZE(old_head) - HEADER_SIZE;
+    void *block = heap_realloc(a, old_ptr, new_size);
+    pthread_mutex_unlock(&a->lock);
+    
+    if (!block && new_size > 0 && new_size <= MAX_REQUEST_SIZE) {
+        block = arena_malloc(new_size);
+        if (block) {
+            memcpy(block, old_ptr, (old_size < new_size) ? old_size : new_size);
+            route_free(old_ptr);
+        }
+    }
+    return block;
+}
+
+// aligned blocks come straight from the heap and are never cached
+void *route_memalign(size_t align, size_t requested_size) {
+    return arena_memalign(align, requested_size);
+}
+
+// heap blocks are carved in runs under one lock hold per arena, trying
+// each arena in turn; they bypass the thread cache, so myfree returns
+// them straight to the heap. Slab objects and mapped blocks are
+// allocated one at a time
+size_t route_malloc_batch(size_t requested_size, size_t n, void **out) {
+    size_t count = 0;
+    if (requested_size > SLAB_MAX_SIZE && !WANTS_MAPPING(requested_size)) {
+        Arena *home = get_thread_arena();
+        Arena *a = home;
+        do {
+            lock_arena(a);
+            count += heap_malloc_batch(a, requested_size, n - count, out + count);
+            pthread_mutex_unlock(&a->lock);
+            if (++a == arenas + num_arenas) {
+                a = arenas;
+            }
+        } while (count < n && a != home);
+    }
+    while (count < n && (out[count] = route_malloc(requested_size)) != NULL) {
+        count++;
+    }
+    return count;
+}
+
+// holds each arena's lock across the runs of its blocks; objects that
+// belong to a cache or slab go through route_free, with no lock held
+void route_free_batch(void **ptrs, size_t n) {
+    Arena *locked = NULL;
+    
+    sort_ptrs(ptrs, n);
+    for (size_t i = 0; i < n; ) {
+        if (!is_plain_block(ptrs[i])) {
+            if (locked) {
+                pthread_mutex_unlock(&locked->lock);
+                locked = NULL;
+            }
+            route_free(ptrs[i++]);
+            continue;
+        }
+        Arena *a = arena_of(ptrs[i]);
+        if (a != locked) {
+            if (locked) {
+                pthread_mutex_unlock(&locked->lock);
+            }
+            lock_arena(a);
+            locked = a;
+        }
+        i = free_run(a, ptrs, i, n);
+    }
+    if (locked) {
+        pthread_mutex_unlock(&locked->lock);
+    }
+}
+
+#endif
+
+/* Statistics
+ * ----------
+ * mymalloc, myrealloc and myfree wrap the routing above and count each
+ * successful call along with the usable bytes it handed out or got back,
+ * so a block from a slab, a thread cache or a mapping counts the same as
+ * one from the heap. Free list searches are counted per arena in
+ * find_block_header, under the arena lock. In the thread-safe build each
+ * thread counts into its own cache slot with relaxed atomic stores, which
+ * myheap_stats can read while the owner keeps counting; threads without
+ * a cache count into shared_stats under stats_lock.
+ */
+#ifdef THREAD_SAFE
+#define STAT_ADD(counter, n) __atomic_store_n(&(counter), (counter) + (n), __ATOMIC_RELAXED)
+#define STAT_LOAD(counter) __atomic_load_n(&(counter), __ATOMIC_RELAXED)
+#else
+#define STAT_ADD(counter, n) ((counter) += (n))
+#define STAT_LOAD(counter) (counter)
+#endif
+
+enum { COUNT_MALLOC, COUNT_REALLOC, COUNT_FREE };
+
+// returns the histogram class of a size: floor(log2(size)), with the
+// last class taking everything larger
+int stats_class(size_t size) {
+    if (size == 0) {
+        return 0;
+    }
+    int cls = (int)(sizeof(long) * 8 - 1) - __builtin_clzl(size);
+    return (cls < STATS_CLASSES) ? cls : STATS_CLASSES - 1;
+}
+
+// counts successful calls of one kind (several at once for the batch
+// calls) in the calling thread's counters: given and taken are the
+// usable bytes they handed out and got back
+void count_call(int call, size_t calls, size_t requested_size, size_t given, size_t taken) {
+    OpStats *st = &shared_stats;
+#ifdef THREAD_SAFE
+    if (my_cache) {
+        st = &my_cache->stats;
+    } else {
+        pthread_mutex_lock(&stats_lock);
+    }
+#endif
+    if (call == COUNT_MALLOC) {
+        STAT_ADD(st->mallocs, calls);
+        STAT_ADD(st->allocs[stats_class(requested_size)], calls);
+    } else if (call == COUNT_REALLOC) {
+        STAT_ADD(st->reallocs, calls);
+    } else {
+        STAT_ADD(st->frees, calls);
+    }
+    STAT_ADD(st->given, given);
+    STAT_ADD(st->taken, taken);
+#ifdef THREAD_SAFE
+    if (!my_cache) {
+        pthread_mutex_unlock(&stats_lock);
+    }
+#else
+    if (st->given - st->taken > peak_bytes) {
+        peak_bytes = st->given - st->taken;
+    }
+#endif
+}
+
+void *mymalloc(size_t requested_size) {
+    void *block = route_malloc(PADDED(requested_size));
+    if (block) {
+        size_t size = usable_size(block);
+        GUARD_BLOCK(block, size);
+        count_call(COUNT_MALLOC, 1, requested_size, size, 0);
+        PROFILE_ALLOC(block, requested_size);
+    }
+    SAMPLE_VALIDATE();
+    return block;
+}
+
+// allocates count * size bytes that read as zeros; counted as a malloc.
+// Returns NULL if the product overflows
+void *mycalloc(size_t count, size_t size) {
+    size_t requested_size;
+    if (__builtin_mul_overflow(count, size, &requested_size)) {
+        return NULL;
+    }
+    void *block = route_calloc(PADDED(requested_size));
+    if (block) {
+        size = usable_size(block);
+        GUARD_BLOCK(block, size);
+        count_call(COUNT_MALLOC, 1, requested_size, size, 0);
+        PROFILE_ALLOC(block, requested_size);
+    }
+    SAMPLE_VALIDATE();
+    return block;
+}
+
+void myfree(void *ptr) {
+    if (ptr) {
+        size_t size = usable_size(ptr);
+        CHECK_BLOCK(ptr, size);
+        count_call(COUNT_FREE, 1, 0, 0, size);
+        PROFILE_FREE(ptr);
+        POISON_BLOCK(ptr, size);
+    }
+    route_free(ptr);
+    SAMPLE_VALIDATE();
+}
+
+// a realloc to size 0 frees the block and counts as a realloc. The
+// profile sees a free and a new allocation
+void *myrealloc(void *old_ptr, size_t new_size) {
+    size_t old_size = 0, size = 0;
+    if (old_ptr) {
+        old_size = usable_size(old_ptr);
+        CHECK_BLOCK(old_ptr, old_size);
+        PROFILE_FREE(old_ptr);
+    }
+    void *block = route_realloc(old_ptr, PADDED(new_size));
+    if (block) {
+        size = usable_size(block);
+        GUARD_BLOCK(block, size);
+        PROFILE_ALLOC(block, new_size);
+    } else if (old_ptr && new_size > 0) {
+        // a failed grow may still have merged free neighbours into the
+        // block, moving its end past the guard word
+        GUARD_BLOCK(old_ptr, usable_size(old_ptr));
+    }
+    if (block || (old_ptr && new_size == 0)) {
+        count_call(COUNT_REALLOC, 1, new_size, size, old_size);
+    }
+    SAMPLE_VALIDATE();
+    return block;
+}
+
+// allocates a block whose address is a multiple of align, a power of
+// two; counted as a malloc. Returns NULL for any other align
+void *mymemalign(size_t align, size_t requested_size) {
+    if (align == 0 || (align & (align - 1)) != 0) {
+        return NULL;
+    }
+    if (align <= ALIGNMENT) {
+        return mymalloc(requested_size);
+    }
+    void *block = route_memalign(align, PADDED(requested_size));
+    if (block) {
+        size_t size = usable_size(block);
+        GUARD_BLOCK(block, size);
+        count_call(COUNT_MALLOC, 1, requested_size, size, 0);
+        PROFILE_ALLOC(block, requested_size);
+    }
+    SAMPLE_VALIDATE();
+    return block;
+}
+
+size_t myusable_size(void *ptr) {
+    return ptr ? usable_size(ptr) : 0;
+}
+
+size_t mymalloc_batch(size_t requested_size, size_t n, void **out) {
+    size_t count = route_malloc_batch(PADDED(requested_size), n, out);
+    if (count > 0) {
+        size_t given = 0;
+        for (size_t i = 0; i < count; i++) {
+            size_t size = usable_size(out[i]);
+            GUARD_BLOCK(out[i], size);
+            given += size;
+            PROFILE_ALLOC(out[i], requested_size);
+        }
+        count_call(COUNT_MALLOC, count, requested_size, given, 0);
+    }
+    SAMPLE_VALIDATE();
+    return count;
+}
+
+void myfree_batch(void **ptrs, size_t n) {
+    size_t calls = 0, taken = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (ptrs[i]) {
+            size_t size = usable_size(ptrs[i]);
+            CHECK_BLOCK(ptrs[i], size);
+            calls++;
+            taken += size;
+            PROFILE_FREE(ptrs[i]);
+            POISON_BLOCK(ptrs[i], size);
+        }
+    }
+    if (calls > 0) {
+        count_call(COUNT_FREE, calls, 0, 0, taken);
+    }
+    route_free_batch(ptrs, n);
+    SAMPLE_VALIDATE();
+}
+
+// adds one set of call counters to a running total
+void add_op_stats(OpStats *total, OpStats *st) {
+    total->mallocs += STAT_LOAD(st->mallocs);
+    total->reallocs += STAT_LOAD(st->reallocs);
+    total->frees += STAT_LOAD(st->frees);
+    total->given += STAT_LOAD(st->given);
+    total->taken += STAT_LOAD(st->taken);
+    for (int i = 0; i < STATS_CLASSES; i++) {
+        total->allocs[i] += STAT_LOAD(st->allocs[i]);
+    }
+}
+
+// adds up the call counters and walks every arena's free lists under
+// its lock. Returns false if the heap has not been initialized
+bool myheap_stats(HeapStats *stats) {
+    if (num_arenas == 0) {
+        return false;
+    }
+    OpStats total = { 0 };
+    memset(stats, 0, sizeof(*stats));
+#ifdef THREAD_SAFE
+    pthread_mutex_lock(&stats_lock);
+    add_op_stats(&total, &shared_stats);
+    for (int i = 1; i <= MAX_THREADS; i++) {
+        add_op_stats(&total, &caches[i].stats);
+    }
+    // threads count on their own, so a free can be seen before its malloc
+    stats->live_bytes = (total.given > total.taken) ? total.given - total.taken : 0;
+    if (stats->live_bytes > peak_bytes) {
+        peak_bytes = stats->live_bytes;
+    }
+    stats->peak_bytes = peak_bytes;
+    pthread_mutex_unlock(&stats_lock);
+#else
+    add_op_stats(&total, &shared_stats);
+    stats->live_bytes = total.given - total.taken;
+    stats->peak_bytes = peak_bytes;
+#endif
+    stats->mallocs = total.mallocs;
+    stats->reallocs = total.reallocs;
+    stats->frees = total.frees;
+    memcpy(stats->allocs, total.allocs, sizeof(stats->allocs));
+    
+    for (int i = 0; i < num_arenas; i++) {
+        Arena *a = &arenas[i];
+#ifdef THREAD_SAFE
+        pthread_mutex_lock(&a->lock);
+#endif
+        stats->heap_bytes += (char *)a->end - (char *)a->top;
+        for (int cls = 0; cls < NUM_SIZE_CLASSES; cls++) {
+            for (Header *cur = a->free_lists[cls]; cur; cur = LIST_NEXT(cur)) {
+                size_t size = GET_SIZE(cur);
+                stats->free_bytes += size;
+                stats->free_blocks[stats_class(size)]++;
+                if (size > stats->largest_free) {
+                    stats->largest_free = size;
+                }
+            }
+        }
+        for (size_t bin = 0; bin < QUICK_BINS; bin++) { // parked blocks count as free
+            size_t size = bin * BLOCK_ALIGN;
+            stats->free_bytes += size * a->quick_counts[bin];
+            stats->free_blocks[stats_class(size)] += a->quick_counts[bin];
+            if (a->quick_counts[bin] > 0 && size > stats->largest_free) {
+                stats->largest_free = size;
+            }
+        }
+        for (int cls = 0; cls < STATS_CLASSES; cls++) {
+            stats->searches[cls] += a->searches[cls];
+            stats->searched[cls] += a->searched[cls];
+        }
+#ifdef THREAD_SAFE
+        pthread_mutex_unlock(&a->lock);
+#endif
+    }
+    if (stats->free_bytes > 0) {
+        stats->fragmentation = 1.0 - (double)stats->largest_free / stats->free_bytes;
+    }
+    return true;
+}
+
+// prints the statistics, then a row per size class that has seen any
+// allocation or search or holds a free block
+void myheap_dump_stats(FILE *fp) {
+    HeapStats stats;
+    if (!myheap_stats(&stats)) {
+        fprintf(fp, "heap not initialized\n");
+        return;
+    }
+    size_t nfree = 0;
+    for (int i = 0; i < STATS_CLASSES; i++) {
+        nfree += stats.free_blocks[i];
+    }
+    fprintf(fp, "live bytes     %zu (peak %zu)\n", stats.live_bytes, stats.peak_bytes);
+    fprintf(fp, "heap bytes     %zu, %zu free in %zu blocks, largest %zu\n",
+            stats.heap_bytes, stats.free_bytes, nfree, stats.largest_free);
+    fprintf(fp, "fragmentation  %.1f%%\n", 100.0 * stats.fragmentation);
+    fprintf(fp, "calls          %zu malloc, %zu realloc, %zu free\n",
+            stats.mallocs, stats.reallocs, stats.frees);
+    fprintf(fp, "%-22s %10s %10s %8s %11s\n", "size", "allocs", "searches", "avg len", "free blocks");
+    for (int i = 0; i < STATS_CLASSES; i++) {
+        if (!stats.allocs[i] && !stats.searches[i] && !stats.free_blocks[i]) {
+            continue;
+        }
+        char range[32];
+        if (i == STATS_CLASSES - 1) {
+            snprintf(range, sizeof(range), "%lu+", 1UL << i);
+        } else {
+            snprintf(range, sizeof(range), "%lu-%lu", i ? 1UL << i : 0, (2UL << i) - 1);
+        }
+        fprintf(fp, "%-22s %10zu %10zu %8.1f %11zu\n", range, stats.allocs[i], stats.searches[i],
+                stats.searches[i] ? (double)stats.searched[i] / stats.searches[i] : 0.0,
+                stats.free_blocks[i]);
+    }
+}
+
+int myarena_count() {
+    return num_arenas;
+}
+
+// reports how much of an arena's slice is in use, walking its free
+// lists under the arena lock
+bool myarena_usage(int arena, ArenaUsage *usage) {
+    if (arena < 0 || arena >= num_arenas) {
+        return false;
+    }
+    Arena *a = &arenas[arena];
+#ifdef THREAD_SAFE
+    pthread_mutex_lock(&a->lock);
+    usage->threads = __atomic_load_n(&a->nthreads, __ATOMIC_RELAXED);
+#else
+    usage->threads = 1;
+#endif
+    usage->heap_size = a->size;
+    usage->bytes_used = a->nused;
+    usage->tail_size = GET_SIZE(a->end);
+    usage->committed = a->committed - (char *)a->top;
+    usage->bytes_free = usage->tail_size;
+    usage->free_blocks = 0;
+    for (int cls = 0; cls < NUM_SIZE_CLASSES; cls++) {
+        for (Header *cur = a->free_lists[cls]; cur; cur = LIST_NEXT(cur)) {
+            usage->bytes_free += GET_SIZE(cur);
+            usage->free_blocks++;
+        }
+    }
+    for (size_t bin = 0; bin < QUICK_BINS; bin++) { // parked blocks count as free
+        usage->bytes_free += bin * BLOCK_ALIGN * a->quick_counts[bin];
+        usage->free_blocks += a->quick_counts[bin];
+    }
+#ifdef THREAD_SAFE
+    pthread_mutex_unlock(&a->lock);
+#endif
+    return true;
+}
+
+/* Heap profile
+ * ------------
+ * Built with -DPROFILE_RATE=n, the public functions sample allocations
+ * as a Poisson process over the bytes requested: each thread counts down
+ * an exponentially distributed number of bytes with mean n, and the
+ * allocation that takes its count below zero is sampled. An allocation
+ * of s bytes is then sampled with probability 1 - exp(-s/n), and stands
+ * for 1 / that many allocations like it.
+ *
+ * A sample records the stack from the caller of the my* function in a
+ * table of call sites, which counts the samples taken there and those
+ * still live, and keeps the block's address until it is freed. A free
+ * looks its address up only if profile_filter, which counts the live
+ * samples per hash of their address, says it may be there. A realloc is
+ * a free and a new allocation, so a failed one drops the old block's
+ * sample. The tables have a fixed size; samples that don't fit are
+ * dropped and counted. Everything runs under profile_lock, with the
+ * thread's in_profile set so that whatever backtrace or stdio allocate
+ * meanwhile is neither sampled nor looked up.
+ */
+#if PROFILE_RATE > 0
+#define PROFILE_DEPTH 32 // frames kept per stack
+#define PROFILE_SKIP 2 // frames of profile_alloc and the my* function
+#define PROFILE_SITES 4096 // distinct stacks, a power of two
+#define PROFILE_SLOT_BITS 16 // room for 2^16 live samples, kept 3/4 full at most
+
+typedef struct profile_site {
+    void *pcs[PROFILE_DEPTH];
+    int depth; // 0 if the slot is unused
+    size_t allocs, alloc_bytes; // samples taken here
+    size_t live, live_bytes; // those not freed yet
+    double est_allocs, est_alloc_bytes; // the same scaled up to all allocations
+    double est_live, est_live_bytes;
+} ProfileSite;
+
+typedef struct profile_sample {
+    void *ptr; // NULL if the slot is unused
+    ProfileSite *site;
+    size_t size;
+} ProfileSample;
+
+static ProfileSite profile_sites[PROFILE_SITES];
+static ProfileSample profile_samples[1 << PROFILE_SLOT_BITS]; // by address, linear probing
+static ProfileSite *profile_order[PROFILE_SITES]; // sites sorted for a dump
+static size_t profile_nsamples; // live samples in profile_samples
+static size_t profile_taken; // samples ever taken, dropped ones included
+static size_t profile_dropped;
+static __thread bool in_profile;
+static __thread uint64_t profile_rng; // 0 until the thread's first allocation
+
+// a random number of bytes until the next sample, exponentially
+// distributed with mean PROFILE_RATE
+size_t profile_gap() {
+    profile_rng = profile_rng * 6364136223846793005UL + 1442695040888963407UL;
+    double u = ((profile_rng >> 11) + 1) * 0x1.0p-53; // in (0, 1]
+    return (size_t)(-log(u) * PROFILE_RATE);
+}
+
+// returns the site for a stack, claiming a free slot for a new one, or
+// NULL if the table is full
+ProfileSite *profile_site(void **pcs, int depth) {
+    size_t hash = depth;
+    for (int i = 0; i < depth; i++) {
+        hash = (hash ^ (uintptr_t)pcs[i]) * 0x100000001B3UL;
+    }
+    for (size_t probe = 0; probe < PROFILE_SITES; probe++) {
+        ProfileSite *site = &profile_sites[(hash + probe) & (PROFILE_SITES - 1)];
+        if (site->depth == 0) {
+            memcpy(site->pcs, pcs, depth * sizeof(void *));
+            site->depth = depth;
+            return site;
+        }
+        if (site->depth == depth && memcmp(site->pcs, pcs, depth * sizeof(void *)) == 0) {
+            return site;
+        }
+    }
+    return NULL;
+}
+
+// counts a sample for the site, or takes it back if sign is -1
+void profile_count(ProfileSite *site, size_t size, int sign) {
+    double weight = 1 / (1 - exp(-(double)size / PROFILE_RATE));
+    if (sign > 0) {
+        site->allocs++;
+        site->alloc_bytes += size;
+        site->est_allocs += weight;
+        site->est_alloc_bytes += weight * size;
+    }
+    site->live += sign;
+    site->live_bytes += sign * (long)size;
+    site->est_live += sign * weight;
+    site->est_live_bytes += sign * weight * size;
+    if (site->live == 0) { // no rounding left over
+        site->est_live = site->est_live_bytes = 0;
+    }
+}
+
+// called when an allocation takes the thread's countdown below zero:
+// samples the block of size bytes at ptr (except on the thread's first
+// allocation, which only starts the countdown) and draws the next gap.
+// Not inlined, so its frame is always the one to skip
+__attribute__((noinline)) void profile_alloc(void *ptr, size_t size) {
+    if (profile_rng == 0 || in_profile) {
+        profile_rng += (uintptr_t)&profile_rng ^ (uintptr_t)ptr ^ 1;
+        bytes_until_sample = profile_gap();
+        return;
+    }
+    bytes_until_sample = profile_gap();
+    in_profile = true;
+    void *pcs[PROFILE_SKIP + PROFILE_DEPTH];
+    int depth = backtrace(pcs, PROFILE_SKIP + PROFILE_DEPTH) - PROFILE_SKIP;
+    if (depth <= 0) { // no stack: one site for all of these
+        pcs[PROFILE_SKIP] = NULL;
+        depth = 1;
+    }
+#ifdef THREAD_SAFE
+    pthread_mutex_lock(&profile_lock);
+#endif
+    profile_taken++;
+    ProfileSite *site = profile_site(pcs + PROFILE_SKIP, depth);
+    if (!site || profile_nsamples >= (3UL << PROFILE_SLOT_BITS) / 4) {
+        profile_dropped++;
+    } else {
+        size_t mask = (1UL << PROFILE_SLOT_BITS) - 1;
+        size_t i = PROFILE_HASH(ptr, PROFILE_SLOT_BITS);
+        while (profile_samples[i].ptr) {
+            i = (i + 1) & mask;
+        }
+        profile_samples[i] = (ProfileSample){ ptr, site, size };
+        profile_nsamples++;
+        profile_count(site, size, 1);
+        unsigned char *count = &profile_filter[PROFILE_HASH(ptr, PROFILE_FILTER_BITS)];
+        if (*count < UCHAR_MAX) { // a full count stays, so lookups go on
+            __atomic_store_n(count, *count + 1, __ATOMIC_RELAXED);
+        }
+    }
+#ifdef THREAD_SAFE
+    pthread_mutex_unlock(&profile_lock);
+#endif
+    in_profile = false;
+}
+
+// empties slot i of profile_samples. Samples further along the run move
+// back to close the gap, so each stays reachable from its home slot
+void profile_remove(size_t i) {
+    size_t mask = (1UL << PROFILE_SLOT_BITS) - 1;
+    for (size_t j = (i + 1) & mask; profile_samples[j].ptr; j = (j + 1) & mask) {
+        size_t home = PROFILE_HASH(profile_samples[j].ptr, PROFILE_SLOT_BITS);
+        bool stays = (i <= j) ? (i < home && home <= j) : (i < home || home <= j);
+        if (!stays) {
+            profile_samples[i] = profile_samples[j];
+            i = j;
+        }
+    }
+    profile_samples[i].ptr = NULL;
+}
+
+// forgets the sample of a block about to be freed, if it has one
+void profile_free(void *ptr) {
+    if (in_profile) {
+        return;
+    }
+#ifdef THREAD_SAFE
+    pthread_mutex_lock(&profile_lock);
+#endif
+    size_t mask = (1UL << PROFILE_SLOT_BITS) - 1;
+    size_t i = PROFILE_HASH(ptr, PROFILE_SLOT_BITS);
+    while (profile_samples[i].ptr && profile_samples[i].ptr != ptr) {
+        i = (i + 1) & mask;
+    }
+    if (profile_samples[i].ptr) {
+        profile_count(profile_samples[i].site, profile_samples[i].size, -1);
+        profile_remove(i);
+        profile_nsamples--;
+        unsigned char *count = &profile_filter[PROFILE_HASH(ptr, PROFILE_FILTER_BITS)];
+        if (*count < UCHAR_MAX) {
+            __atomic_store_n(count, *count - 1, __ATOMIC_RELAXED);
+        }
+    }
+#ifdef THREAD_SAFE
+    pthread_mutex_unlock(&profile_lock);
+#endif
+}
+
+// drops every site and sample; only called from myinit, which discards
+// the blocks they describe
+void profile_reset() {
+    if (profile_taken > 0) {
+        memset(profile_sites, 0, sizeof(profile_sites));
+        memset(profile_samples, 0, sizeof(profile_samples));
+        memset(profile_filter, 0, sizeof(profile_filter));
+    }
+    profile_nsamples = profile_taken = profile_dropped = 0;
+}
+
+// orders sites by estimated live bytes, then bytes allocated
+int compare_sites(const void *a, const void *b) {
+    const ProfileSite *x = *(ProfileSite * const *)a, *y = *(ProfileSite * const *)b;
+    int order = (x->est_live_bytes < y->est_live_bytes) - (x->est_live_bytes > y->est_live_bytes);
+    if (order) {
+        return order;
+    }
+    return (x->est_alloc_bytes < y->est_alloc_bytes) - (x->est_alloc_bytes > y->est_alloc_bytes);
+}
+
+// prints a frame as its address, then the symbol (or the object it is
+// in) and the offset from there
+void print_frame(FILE *fp, void *pc) {
+    Dl_info info;
+    if (pc && dladdr(pc, &info) && info.dli_sname) {
+        fprintf(fp, "    %-18p %s+%#lx\n", pc, info.dli_sname, (char *)pc - (char *)info.dli_saddr);
+    } else if (pc && dladdr(pc, &info) && info.dli_fname) {
+        const char *name = strrchr(info.dli_fname, '/');
+        fprintf(fp, "    %-18p %s+%#lx\n", pc, name ? name + 1 : info.dli_fname,
+                (char *)pc - (char *)info.dli_fbase);
+    } else {
+        fprintf(fp, "    %p\n", pc);
+    }
+}
+
+// copies the process's mappings, which pprof needs to find the objects
+// the addresses belong to; read without stdio, which would allocate
+void print_mappings(FILE *fp) {
+    char buf[4096];
+    ssize_t n;
+    int fd = open("/proc/self/maps", O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        fwrite(buf, 1, n, fp);
+    }
+    close(fd);
+}
+#endif
+
+// prints the sampled sites, most live bytes first: with pprof set in the
+// legacy heap profile format pprof reads (sampled counts, which pprof
+// scales up itself), otherwise as estimated totals with the stacks
+// symbolized where the dynamic symbol table allows. Returns false, and
+// prints nothing, unless built with -DPROFILE_RATE
+bool myheap_dump_profile(FILE *fp, bool pprof) {
+#if PROFILE_RATE > 0
+    in_profile = true;
+#ifdef THREAD_SAFE
+    pthread_mutex_lock(&profile_lock);
+#endif
+    size_t nsites = 0;
+    size_t live = 0, live_bytes = 0, allocs = 0, alloc_bytes = 0;
+    double est_live_bytes = 0, est_alloc_bytes = 0;
+    for (size_t i = 0; i < PROFILE_SITES; i++) {
+        ProfileSite *site = &profile_sites[i];
+        if (site->depth) {
+            profile_order[nsites++] = site;
+            live += site->live;
+            live_bytes += site->live_bytes;
+            allocs += site->allocs;
+            alloc_bytes += site->alloc_bytes;
+            est_live_bytes += site->est_live_bytes;
+            est_alloc_bytes += site->est_alloc_bytes;
+        }
+    }
+    qsort(profile_order, nsites, sizeof(ProfileSite *), compare_sites);
+    if (pprof) {
+        fprintf(fp, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%ld\n",
+                live, live_bytes, allocs, alloc_bytes, (long)PROFILE_RATE);
+        for (size_t i = 0; i < nsites; i++) {
+            ProfileSite *site = profile_order[i];
+            fprintf(fp, "%zu: %zu [%zu: %zu] @", site->live, site->live_bytes,
+                    site->allocs, site->alloc_bytes);
+            for (int j = 0; j < site->depth; j++) {
+                fprintf(fp, " %p", site->pcs[j]);
+            }
+            fprintf(fp, "\n");
+        }
+        fprintf(fp, "\nMAPPED_LIBRARIES:\n");
+        fflush(fp);
+        print_mappings(fp);
+    } else {
+        fprintf(fp, "heap profile: one sample per %ld bytes, %zu taken, %zu dropped\n",
+                (long)PROFILE_RATE, profile_taken, profile_dropped);
+        fprintf(fp, "estimated %.0f bytes live, %.0f allocated, in %zu sites\n",
+                est_live_bytes, est_alloc_bytes, nsites);
+        fprintf(fp, "%14s %10s %14s %10s\n", "live bytes", "live objs", "alloc bytes", "alloc objs");
+        for (size_t i = 0; i < nsites; i++) {
+            ProfileSite *site = profile_order[i];
+            fprintf(fp, "%14.0f %10.0f %14.0f %10.0f\n", site->est_live_bytes, site->est_live,
+                    site->est_alloc_bytes, site->est_allocs);
+            for (int j = 0; j < site->depth; j++) {
+                print_frame(fp, site->pcs[j]);
+            }
+        }
+    }
+#ifdef THREAD_SAFE
+    pthread_mutex_unlock(&profile_lock);
+#endif
+    in_profile = false;
+    return true;
+#else
+    (void)fp;
+    (void)pprof;
+    return false;
+#endif
+}
+
+// checks every arena in one walk of its blocks plus one of its free
+// lists (see check_blocks and check_free_lists). Returns false at the
+// first problem, having printed it to stderr
+bool validate_heap() {
+    for (int i = 0; i < num_arenas; i++) {
+        Arena *a = &arenas[i];
+        size_t nfree = 0;
+#ifdef THREAD_SAFE
+        pthread_mutex_lock(&a->lock);
+#endif
+        bool valid = check_blocks(a, &nfree) && check_free_lists(a, nfree);
+#ifdef THREAD_SAFE
+        pthread_mutex_unlock(&a->lock);
+#endif
+        if (!valid) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// walks the arena's blocks from top to end, checking that each is
+// aligned and sized to stay inside the slice, that its prev free bit
+// tells the truth, that no two free blocks touch, that free blocks keep
+// their footer, and that end closes the slice. Counts the free blocks
+// other than end into *nfree and checks the used ones against nused
+// (parked blocks included)
+bool check_blocks(Arena *a, size_t *nfree) {
+    char *slice_end = (char *)a->top + a->size;
+    size_t used = 0;
+    bool prev_free = false;
+    
+    for (Header *cur = a->top; ; cur = GET_NEXT_HEADER(cur)) {
+        size_t size = GET_SIZE(cur);
+        if ((char *)cur < (char *)a->top || (char *)cur + HEADER_SIZE > slice_end) {
+            return heap_error("block outside the arena", cur);
+        }
+#ifdef HARDENED
+        if (!canary_ok(cur)) {
+            return heap_error("header canary wrong", cur);
+        }
+#endif
+        if (((unsigned long)(GET_MEMORY(cur)) & (BLOCK_ALIGN - 1)) != 0 || size % BLOCK_ALIGN != 0) {
+            return heap_error("misaligned block", cur);
+        }
+        if ((size < MIN_BLOCK_SIZE && cur != a->end) || size > (size_t)(slice_end - (char *)cur)) {
+            return heap_error("bad block size", cur);
+        }
+        if (!GET_PREV_FREE(cur) != !prev_free) {
+            return heap_error("prev free bit wrong", cur);
+        }
+        bool is_free = !GET_USED(cur);
+        if (is_free && prev_free) {
+            return heap_error("free neighbours not coalesced", cur);
+        }
+        if (cur == a->end) {
+            if (!is_free || (char *)cur + size != slice_end) {
+                return heap_error("end is not the free tail of the arena", cur);
+            }
+            break;
+        }
+        if (is_free) {
+            if (GET(GET_FOOTER(cur)) != size) {
+                return heap_error("footer does not match header", cur);
+            }
+            (*nfree)++;
+        } else {
+            if (GET_RELEASED(cur)) {
+                return heap_error("released bit on a used block", cur);
+            }
+            used += size - HEADER_SIZE;
+        }
+        prev_free = is_free;
+    }
+    if (used != a->nused + a->parked) {
+        return heap_error("nused does not match the used blocks", a->top);
+    }
+    return true;
+}
+
+// walks each size class list, checking that its blocks are free blocks
+// of the arena in the right class and that every prev link mirrors the
+// next link that led there, and that the non-empty bitmap agrees. With
+// the links symmetric no block can be reached twice (it would have two
+// predecessors), so nfree blocks listed means each free block is on
+// exactly one list. A list longer than nfree must loop, and stops there
+bool check_free_lists(Arena *a, size_t nfree) {
+    size_t listed = 0;
+    
+    for (int cls = 0; cls < NUM_SIZE_CLASSES; cls++) {
+        Header *prev = NULL;
+        if (!a->free_lists[cls] != !(a->nonempty_classes & (1UL << cls))) {
+            return heap_error("non-empty class bitmap wrong", a->free_lists[cls]);
+        }
+        for (Header *cur = a->free_lists[cls]; cur; prev = cur, cur = LIST_NEXT(cur)) {
+            if ((char *)cur < (char *)a->top || cur >= a->end) {
+                return heap_error("listed block outside the arena", cur);
+            }
+            if (GET_USED(cur) || size_class(GET_SIZE(cur)) != cls) {
+                return heap_error("listed block used or in the wrong class", cur);
+            }
+            if (LIST_PREV(cur) != prev) {
+                return heap_error("prev link does not match", cur);
+            }
+            if (++listed > nfree) {
+                return heap_error("more blocks listed than free", cur);
+            }
+        }
+    }
+    if (listed != nfree) {
+        return heap_error("free block missing from the lists", a->top);
+    }
+    return check_quick_lists(a);
+}
+
+// checks that each quick list holds as many used blocks of the arena as
+// its count says, all of its size, and that the bitmap and parked agree
+bool check_quick_lists(Arena *a) {
+    size_t parked = 0;
+    
+    for (size_t bin = 0; bin < QUICK_BINS; bin++) {
+        int count = 0;
+        if (!a->quick[bin] != !(a->quick_map[bin / 64] & (1UL << (bin % 64)))) {
+            return heap_error("quick list bitmap wrong", a->quick[bin]);
+        }
+        for (Header *cur = a->quick[bin]; cur; cur = LIST_NEXT(cur)) {
+            if ((char *)cur < (char *)a->top || cur >= a->end) {
+                return heap_error("parked block outside the arena", cur);
+            }
+            if (!GET_USED(cur) || GET_SIZE(cur) != bin * BLOCK_ALIGN) {
+                return heap_error("parked block free or in the wrong list", cur);
+            }
+            if (++count > a->quick_counts[bin]) {
+                return heap_error("quick list longer than its count", cur);
+            }
+            parked += GET_SIZE(cur) - HEADER_SIZE;
+        }
+        if (count != a->quick_counts[bin]) {
+            return heap_error("quick list shorter than its count", a->quick[bin]);
+        }
+    }
+    if (parked != a->parked) {
+        return heap_error("parked does not match the quick lists", a->top);
+    }
+    return true;
+}
+
+// reports a problem validate_heap found, stopping in the debugger if
+// there is one. Returns false for the check to pass on
+bool heap_error(const char *msg, void *where) {
+    fprintf(stderr, "validate_heap: %s at %p\n", msg, where);
+    breakpoint();
+    return false;
+}
+
+// Built with -DVALIDATE_RATE=n, every n-th call of the public functions
+// runs validate_heap when it is done and aborts if the heap is broken, so
+// long runs can keep checking at a fraction of the cost of checking
+// every call
+#if VALIDATE_RATE > 0
+void sample_validate() {
+    static unsigned long ncalls;
+#ifdef THREAD_SAFE
+    unsigned long call = __atomic_add_fetch(&ncalls, 1, __ATOMIC_RELAXED);
+#else
+    unsigned long call = ++ncalls;
+#endif
+    if (call % VALIDATE_RATE == 0 && !validate_heap()) {
+        fprintf(stderr, "heap broken after call %lu\n", call);
+        abort();
+    }
+}
+#endif
+
+// prints header address and header info (ie total size and
+// allocation) of each free block, one size class at a time
+void print_linked_list(Arena *a) {
+    printf("linked list: \n");
+    for (int cls = 0; cls < NUM_SIZE_CLASSES; cls++) {
+        Header *cur = a->free_lists[cls];
+        if (cur) {
+            printf("size class %d:\n", cls);
+        }
+        while (cur) {
+            printf("Header Address: %p   ; Header: %lu\n", cur, (unsigned long)GET(cur));
+            cur = LIST_NEXT(cur); //header
         }
-        printf("Header Address: %p   ; Header: %lu", cur, GET(cur));
-        printf("\n\n");
     }
+    printf("end: %p   ; Header: %lu\n\n", a->end, (unsigned long)GET(a->end));
 }
 
-// prints entire heap from segment_start address
+// prints entire arena from the start of its slice
 // prints address and header information
-void print_heap() {
-    Header *cur = segment_start;
+void print_heap(Arena *a) {
+    Header *cur = a->top;
     printf("Print entire heap: \n");
-    if (cur != end) {
-        while(cur != GET_NEXT_HEADER(end)) {
-            printf("Header Address: %p ; Header: %lu\n", cur, GET(cur));
+    if (cur != a->end) {
+        while(cur != GET_NEXT_HEADER(a->end)) {
+            printf("Header Address: %p ; Header: %lu\n", cur, (unsigned long)GET(cur));
             cur = GET_NEXT_HEADER(cur);
         }
     } else {
-     printf("Header Address: %p   ; Header: %lu", cur, GET(cur));
+     printf("Header Address: %p   ; Header: %lu", cur, (unsigned long)GET(cur));
         printf("\n\n");
     }
 }
@@ -0,0 +1,179 @@
+/* File: fs_bench.c
+ * ----------------
+ * False sharing benchmark for the thread-safe explicit allocator. For
+ * each object size, threads take turns to malloc their objects, so the
+ * heap hands them out interleaved, then each thread keeps updating the
+ * first and last word of its own objects. Prints, per size, how many of
+ * the cache lines the objects cover are shared by objects of different
+ * threads, and the updates per second: every shared line is written by
+ * two cores at once, and bounces between them, once the threads run on
+ * more than one. fs_bench_aligned is the same on the -DCACHE_ALIGNED
+ * build.
+ *
+ * usage: fs_bench [-t threads] [-n objects_per_thread] [-r rounds] [size ...]
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "allocator.h"
+#include "segment.h"
+
+#define HEAP_SIZE (1L << 32)
+#define LINE 64
+#define MAX_THREADS 64
+#define MAX_OBJECTS 1024
+
+typedef struct {
+    int id;
+    size_t size;
+    long *objs[MAX_OBJECTS];
+} Worker;
+
+typedef struct {
+    uintptr_t line;
+    int thread;
+} LineUse;
+
+static int nthreads = 4;
+static int nobjs = 64;
+static long rounds = 100000;
+static Worker workers[MAX_THREADS];
+static pthread_barrier_t ready;
+static int turn; // allocations made so far, all threads together
+
+static void *worker(void *arg) {
+    Worker *w = arg;
+    size_t last = w->size / sizeof(long) - 1;
+
+    for (int i = 0; i < nobjs; i++) {
+        while (__atomic_load_n(&turn, __ATOMIC_ACQUIRE) % nthreads != w->id) {
+            sched_yield(); // another thread's turn to allocate
+        }
+        w->objs[i] = mymalloc(w->size);
+        if (w->objs[i] == NULL) {
+            fprintf(stderr, "heap full\n");
+            exit(1);
+        }
+        memset(w->objs[i], 0, w->size);
+        __atomic_fetch_add(&turn, 1, __ATOMIC_RELEASE);
+    }
+    pthread_barrier_wait(&ready);
+    for (long r = 0; r < rounds; r++) {
+        for (int i = 0; i < nobjs; i++) {
+            volatile long *obj = w->objs[i];
+            obj[0]++;
+            obj[last]++;
+        }
+    }
+    return NULL;
+}
+
+static int compare_uses(const void *a, const void *b) {
+    const LineUse *x = a, *y = b;
+    if (x->line != y->line) {
+        return x->line < y->line ? -1 : 1;
+    }
+    return x->thread - y->thread;
+}
+
+// counts the lines the objects cover, and those that more than one
+// thread's objects cover
+static void count_lines(size_t size, size_t *lines, size_t *shared) {
+    size_t per_obj = size / LINE + 2;
+    LineUse *uses = malloc(nthreads * nobjs * per_obj * sizeof(LineUse));
+    size_t n = 0;
+
+    for (int t = 0; t < nthreads; t++) {
+        for (int i = 0; i < nobjs; i++) {
+            uintptr_t start = (uintptr_t)workers[t].objs[i];
+            for (uintptr_t line = start / LINE; line <= (start + size - 1) / LINE; line++) {
+                uses[n++] = (LineUse){line, t};
+            }
+        }
+    }
+    qsort(uses, n, sizeof(LineUse), compare_uses);
+    *lines = *shared = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (i == 0 || uses[i].line != uses[i - 1].line) {
+            (*lines)++;
+        } else if (uses[i].thread != uses[i - 1].thread) {
+            (*shared)++;
+            while (i + 1 < n && uses[i + 1].line == uses[i].line) {
+                i++; // count the line once however many threads share it
+            }
+        }
+    }
+    free(uses);
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char *argv[]) {
+    static const size_t default_sizes[] = {16, 48, 64, 100, 240, 400, 1000, 2000, 4000};
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:n:r:")) != -1) {
+        switch (opt) {
+            case 't': nthreads = atoi(optarg); break;
+            case 'n': nobjs = atoi(optarg); break;
+            case 'r': rounds = atol(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-t threads] [-n objects_per_thread] [-r rounds] [size ...]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (nthreads < 2 || nthreads > MAX_THREADS || nobjs < 1 || nobjs > MAX_OBJECTS || rounds < 1) {
+        fprintf(stderr, "bad arguments\n");
+        return 1;
+    }
+    if (!init_heap_segment(HEAP_SIZE) || !myinit(heap_segment_start(), heap_segment_size())) {
+        fprintf(stderr, "heap initialization failed\n");
+        return 1;
+    }
+
+    int nsizes = (optind < argc) ? argc - optind : sizeof(default_sizes) / sizeof(default_sizes[0]);
+    printf("%d threads, %ld online CPUs\n", nthreads, sysconf(_SC_NPROCESSORS_ONLN));
+    printf(" size    lines   shared   Mupdates/s\n");
+    for (int s = 0; s < nsizes; s++) {
+        size_t size = (optind < argc) ? strtoul(argv[optind + s], NULL, 0) : default_sizes[s];
+        if (size < sizeof(long)) {
+            fprintf(stderr, "size %zu too small\n", size);
+            return 1;
+        }
+        pthread_t threads[MAX_THREADS];
+        turn = 0;
+        pthread_barrier_init(&ready, NULL, nthreads + 1);
+        for (int t = 0; t < nthreads; t++) {
+            workers[t].id = t;
+            workers[t].size = size;
+            pthread_create(&threads[t], NULL, worker, &workers[t]);
+        }
+        pthread_barrier_wait(&ready);
+        double start = now();
+        for (int t = 0; t < nthreads; t++) {
+            pthread_join(threads[t], NULL);
+        }
+        double mupdates = 2.0 * nthreads * nobjs * rounds / (now() - start) / 1e6;
+        pthread_barrier_destroy(&ready);
+
+        size_t lines, shared;
+        count_lines(size, &lines, &shared);
+        printf("%5zu %8zu %8zu %12.1f\n", size, lines, shared, mupdates);
+        for (int t = 0; t < nthreads; t++) {
+            for (int i = 0; i < nobjs; i++) {
+                myfree(workers[t].objs[i]);
+            }
+        }
+    }
+    return validate_heap() ? 0 : 1;
+}
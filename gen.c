@@ -0,0 +1,367 @@
+/* File: gen.c
+ * -----------
+ * Generates synthetic allocation workloads from parameterized
+ * distributions. It writes them as .script traces (see replay.c), or with
+ * -x runs them straight against the allocator it is linked with (see
+ * `make gen_explicit` etc.), so runs of tens of millions of requests need
+ * no trace file.
+ *
+ * The workload is a sequence of requests on a live set of objects:
+ *   - sizes come from a histogram: -s "16:40,64:30,1024:5" means 40 parts
+ *     sizes 1..16, 30 parts 17..64 and 5 parts 65..1024, uniform within
+ *     each bucket
+ *   - objects are freed in one of three orders (-f):
+ *       lifetime  each object lives for an exponentially distributed
+ *                 number of allocations with mean -l (the default)
+ *       fifo      producer/consumer: once -L objects are live, the
+ *                 oldest is freed first
+ *       lifo      once -L objects are live, the newest is freed first
+ *   - -r percent of requests resize a random live object by the growth
+ *     factor -g (a factor below 1 shrinks)
+ * When -n requests have been made the remaining objects are freed.
+ *
+ * usage: gen [-n requests] [-s histogram] [-f lifetime|fifo|lifo] [-l mean]
+ *            [-L max_live] [-r realloc_percent] [-g growth] [-S seed]
+ *            [-o file | -x [-i interval]]
+ *   -x  run against the allocator, printing throughput every -i requests
+ *       (default a tenth of the run) to show slowdowns as the heap grows
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include "allocator.h"
+#include "segment.h"
+
+#define HEAP_SIZE (1L << 32) // only reserved: the allocator commits what it uses
+#define MAX_BUCKETS 32
+#define DEFAULT_HISTOGRAM "16:35,32:25,64:15,128:10,512:8,4096:5,65536:2"
+
+enum { FREE_LIFETIME, FREE_FIFO, FREE_LIFO };
+
+// workload parameters
+static long num_requests = 1000000;
+static int free_order = FREE_LIFETIME;
+static double mean_lifetime = 10000;
+static size_t max_live = 100000;
+static double realloc_percent = 5;
+static double growth = 1.5;
+static uint64_t seed = 1; // -S, kept for the trace header
+static uint64_t rng_state;
+
+// size histogram: bucket i holds sizes up to bucket_max[i]
+static size_t bucket_max[MAX_BUCKETS];
+static double bucket_cdf[MAX_BUCKETS];
+static int num_buckets;
+
+// the live set. ids index sizes, live_index and death; freed ids are
+// recycled so every table stays max_live + 1 long
+static size_t *sizes;
+static size_t *live_index; // position of the id in live
+static uint64_t *death; // allocation count at which the object dies
+static size_t *live; // live ids, in no order (realloc picks from it)
+static size_t num_live;
+static size_t *free_ids;
+static size_t num_free_ids;
+static size_t *order; // free order: heap by death, or queue/stack by age
+static size_t order_head, order_count;
+
+// where requests go: a script file, or the allocator
+static FILE *script;
+static void **ptrs;
+static long requests_done;
+
+static uint64_t next_rand() {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static double rand_unit() {
+    return (next_rand() >> 11) * (1.0 / 9007199254740992.0); // [0, 1)
+}
+
+// parses "max:weight,..." into the size histogram. Returns false if it
+// is malformed
+static bool parse_histogram(const char *spec) {
+    double total = 0;
+    size_t prev_max = 0;
+    num_buckets = 0;
+    while (*spec) {
+        char *end;
+        size_t max = strtoul(spec, &end, 10);
+        if (*end != ':' || max <= prev_max || max > MAX_REQUEST_SIZE || num_buckets == MAX_BUCKETS) {
+            return false;
+        }
+        double weight = strtod(end + 1, &end);
+        if (weight < 0 || (*end != ',' && *end != '\0')) {
+            return false;
+        }
+        bucket_max[num_buckets] = max;
+        total += weight;
+        bucket_cdf[num_buckets++] = total;
+        prev_max = max;
+        spec = (*end == ',') ? end + 1 : end;
+    }
+    if (num_buckets == 0 || total <= 0) {
+        return false;
+    }
+    for (int i = 0; i < num_buckets; i++) {
+        bucket_cdf[i] /= total;
+    }
+    return true;
+}
+
+static size_t random_size() {
+    double u = rand_unit();
+    int i = 0;
+    while (i < num_buckets - 1 && u >= bucket_cdf[i]) {
+        i++;
+    }
+    size_t lo = (i == 0) ? 1 : bucket_max[i - 1] + 1;
+    return lo + next_rand() % (bucket_max[i] - lo + 1);
+}
+
+// sends one request to the script or the allocator
+static void emit(char type, size_t id, size_t size) {
+    requests_done++;
+    if (script) {
+        if (type == 'f') {
+            fprintf(script, "f %zu\n", id);
+        } else {
+            fprintf(script, "%c %zu %zu\n", type, id, size);
+        }
+        return;
+    }
+    if (type == 'a') {
+        ptrs[id] = mymalloc(size);
+    } else if (type == 'r') {
+        ptrs[id] = myrealloc(ptrs[id], size);
+    } else {
+        myfree(ptrs[id]);
+        ptrs[id] = NULL;
+    }
+    if (type != 'f' && ptrs[id] == NULL) {
+        fprintf(stderr, "request %ld: %s of %zu bytes failed\n", requests_done,
+                type == 'a' ? "malloc" : "realloc", size);
+        exit(1);
+    }
+}
+
+// binary min-heap on death, for the lifetime free order
+static bool dies_before(size_t a, size_t b) {
+    return death[order[a]] < death[order[b]];
+}
+
+static void swap_order(size_t a, size_t b) {
+    size_t tmp = order[a];
+    order[a] = order[b];
+    order[b] = tmp;
+}
+
+static void heap_push(size_t id) {
+    size_t i = order_count++;
+    order[i] = id;
+    while (i > 0 && dies_before(i, (i - 1) / 2)) {
+        swap_order(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+}
+
+static size_t heap_pop() {
+    size_t id = order[0];
+    order[0] = order[--order_count];
+    for (size_t i = 0; ; ) {
+        size_t child = 2 * i + 1;
+        if (child >= order_count) {
+            break;
+        }
+        if (child + 1 < order_count && dies_before(child + 1, child)) {
+            child++;
+        }
+        if (!dies_before(child, i)) {
+            break;
+        }
+        swap_order(i, child);
+        i = child;
+    }
+    return id;
+}
+
+static void allocate(uint64_t clock) {
+    size_t id = free_ids[--num_free_ids];
+    sizes[id] = random_size();
+    live_index[id] = num_live;
+    live[num_live++] = id;
+    emit('a', id, sizes[id]);
+
+    if (free_order == FREE_LIFETIME) {
+        death[id] = clock + 1 + (uint64_t)(-log(1 - rand_unit()) * mean_lifetime);
+        heap_push(id);
+    } else if (free_order == FREE_FIFO) {
+        order[(order_head + order_count++) % (max_live + 1)] = id;
+    } else {
+        order[order_count++] = id;
+    }
+}
+
+static void release(size_t id) {
+    emit('f', id, 0);
+    size_t last = live[--num_live];
+    live[live_index[id]] = last;
+    live_index[last] = live_index[id];
+    free_ids[num_free_ids++] = id;
+}
+
+// frees the object next in the free order
+static void release_next() {
+    size_t id;
+    if (free_order == FREE_LIFETIME) {
+        id = heap_pop();
+    } else if (free_order == FREE_FIFO) {
+        id = order[order_head];
+        order_head = (order_head + 1) % (max_live + 1);
+        order_count--;
+    } else {
+        id = order[--order_count];
+    }
+    release(id);
+}
+
+static void resize_random() {
+    size_t id = live[next_rand() % num_live];
+    size_t size = (size_t)(sizes[id] * growth);
+    if (size == 0) {
+        size = 1;
+    } else if (size > MAX_REQUEST_SIZE) {
+        size = MAX_REQUEST_SIZE;
+    }
+    sizes[id] = size;
+    emit('r', id, size);
+}
+
+static double wall_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// generates the workload, reporting throughput every interval requests
+// when running against the allocator
+static void run(long interval) {
+    uint64_t clock = 0; // allocations so far
+    double start = wall_seconds(), last = start;
+    long last_done = 0;
+
+    while (requests_done < num_requests) {
+        bool due = (free_order == FREE_LIFETIME)
+            ? order_count > 0 && death[order[0]] <= clock
+            : num_live >= max_live;
+        if (due || num_free_ids == 0) {
+            release_next();
+        } else if (num_live > 0 && rand_unit() * 100 < realloc_percent) {
+            resize_random();
+        } else {
+            allocate(clock++);
+        }
+        if (!script && requests_done - last_done >= interval) {
+            double now = wall_seconds();
+            printf("%12ld requests %10zu live %10.2f Mops/s\n", requests_done, num_live,
+                   (requests_done - last_done) / (now - last) / 1e6);
+            last = now;
+            last_done = requests_done;
+        }
+    }
+    while (order_count > 0) {
+        release_next();
+    }
+    if (!script) {
+        double seconds = wall_seconds() - start;
+        printf("%ld requests in %.3f s: %.2f Mops/s\n", requests_done, seconds,
+               requests_done / seconds / 1e6);
+    }
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-n requests] [-s histogram] [-f lifetime|fifo|lifo] [-l mean]\n"
+            "       [-L max_live] [-r realloc_percent] [-g growth] [-S seed]\n"
+            "       [-o file | -x [-i interval]]\n", name);
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    const char *histogram = DEFAULT_HISTOGRAM;
+    const char *out_path = NULL;
+    bool execute = false;
+    long interval = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:s:f:l:L:r:g:S:o:xi:")) != -1) {
+        switch (opt) {
+            case 'n': num_requests = atol(optarg); break;
+            case 's': histogram = optarg; break;
+            case 'f':
+                if (strcmp(optarg, "lifetime") == 0) free_order = FREE_LIFETIME;
+                else if (strcmp(optarg, "fifo") == 0) free_order = FREE_FIFO;
+                else if (strcmp(optarg, "lifo") == 0) free_order = FREE_LIFO;
+                else usage(argv[0]);
+                break;
+            case 'l': mean_lifetime = atof(optarg); break;
+            case 'L': max_live = atol(optarg); break;
+            case 'r': realloc_percent = atof(optarg); break;
+            case 'g': growth = atof(optarg); break;
+            case 'S': seed = strtoull(optarg, NULL, 10) | 1; break;
+            case 'o': out_path = optarg; break;
+            case 'x': execute = true; break;
+            case 'i': interval = atol(optarg); break;
+            default: usage(argv[0]);
+        }
+    }
+    if (num_requests <= 0 || max_live == 0 || mean_lifetime <= 0 || growth <= 0 ||
+        (execute && out_path) || optind != argc) {
+        usage(argv[0]);
+    }
+    if (!parse_histogram(histogram)) {
+        fprintf(stderr, "bad size histogram: %s\n", histogram);
+        return 1;
+    }
+    rng_state = seed;
+
+    sizes = malloc((max_live + 1) * sizeof(size_t));
+    live_index = malloc((max_live + 1) * sizeof(size_t));
+    death = malloc((max_live + 1) * sizeof(uint64_t));
+    live = malloc((max_live + 1) * sizeof(size_t));
+    order = malloc((max_live + 1) * sizeof(size_t));
+    free_ids = malloc((max_live + 1) * sizeof(size_t));
+    for (size_t i = 0; i <= max_live; i++) {
+        free_ids[num_free_ids++] = max_live - i; // hand out low ids first
+    }
+
+    if (execute) {
+        ptrs = calloc(max_live + 1, sizeof(void *));
+        if (!init_heap_segment(HEAP_SIZE) || !myinit(heap_segment_start(), heap_segment_size())) {
+            fprintf(stderr, "heap initialization failed\n");
+            return 1;
+        }
+        run(interval > 0 ? interval : (num_requests + 9) / 10);
+    } else {
+        script = out_path ? fopen(out_path, "w") : stdout;
+        if (!script) {
+            perror(out_path);
+            return 1;
+        }
+        fprintf(script, "# gen -n %ld -s %s -f %s -l %g -L %zu -r %g -g %g -S %llu\n", num_requests,
+                histogram, free_order == FREE_LIFETIME ? "lifetime" : free_order == FREE_FIFO ? "fifo" : "lifo",
+                mean_lifetime, max_live, realloc_percent, growth, (unsigned long long)seed);
+        run(num_requests);
+        if (script != stdout) {
+            fclose(script);
+        }
+    }
+    return 0;
+}
@@ -6,25 +6,80 @@
 /* Features of implicit:
    - Headers that track block information (8byte)
    - Free blocks that are recycled and reused for subsequent malloc requests if possible
-   - malloc implementation searches heap for free blocks with implicit list
+   - malloc implementation searches heap for free blocks with implicit list,
+     or (by default) looks them up in a best-fit index of free blocks
+     bucketed by size; build with -DBEST_FIT_INDEX=0 for the plain scan
+   - Free blocks carry a footer and the block after them a "previous block
+     free" bit, so free coalesces with both neighbours in O(1)
+   - The segment is committed as the heap grows, and the written part of
+     the tail beyond the last block goes back to the OS once it is large
+   - Call counts, live bytes and free block search lengths are kept for
+     myheap_stats (see the bottom of this file)
  */
 
 #include "allocator.h"
 #include "debug_break.h"
+#include "segment.h"
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #define HEADER_SIZE 8
 
+// The best-fit index keeps every free block (except past the end) on a
+// list for its size bucket: one bucket per size up to EXACT_MAX_SIZE, and
+// SUB_BUCKETS buckets splitting each power of two above it. A bitmap of
+// non-empty buckets finds the next bucket with blocks in a few word scans
+#ifndef BEST_FIT_INDEX
+#define BEST_FIT_INDEX 1
+#endif
+
+#if BEST_FIT_INDEX
+#define MIN_BLOCK_SIZE 32 // header, list pointers and footer once freed
+#define EXACT_MAX_SIZE 1024
+#define EXACT_BUCKETS ((EXACT_MAX_SIZE - MIN_BLOCK_SIZE) / ALIGNMENT + 1)
+#define SUB_BITS 3
+#define SUB_BUCKETS (1 << SUB_BITS)
+#define FIRST_RANGE_SHIFT 10 // log2(EXACT_MAX_SIZE)
+#define NUM_BUCKETS (EXACT_BUCKETS + (48 - FIRST_RANGE_SHIFT) * SUB_BUCKETS)
+#define BUCKET_WORDS ((NUM_BUCKETS + 63) / 64)
+#else
+#define MIN_BLOCK_SIZE 16 // header + footer once the block is freed
+#endif
+#define COMMIT_CHUNK (1L << 20) // segment is committed this much at a time
+#ifndef TRIM_THRESHOLD
+#define TRIM_THRESHOLD (128L << 10) // written tail bytes kept before release
+#endif
+#define PAGE_SIZE 4096
+
+// -DVALIDATE_RATE=n validates the heap after every n-th call (see
+// sample_validate at the bottom of this file)
+#ifndef VALIDATE_RATE
+#define VALIDATE_RATE 0
+#endif
+#if VALIDATE_RATE > 0
+#define SAMPLE_VALIDATE() sample_validate()
+#else
+#define SAMPLE_VALIDATE()
+#endif
+
 #define GET(p) (*(Header *)p).sa_bit //extracts header bits
 #define GET_HEADER(blk) (Header *)blk - 1
 #define GET_MEMORY(p) p + 1
 #define GET_USED(p) (GET(p) & 0x1) //gets least significant bit
+#define GET_PREV_FREE(p) (GET(p) & 0x2) // set if block on the left is free
 #define GET_SIZE(p) (GET(p) & ~0x7) // 3 LSB hold allocated status
 #define SET_HEADER(p, val) (GET(p) = val)
 #define SET_USED(p) (GET(p) |=  0x1)
 #define SET_UNUSED(p) (GET(p) &= ~0x1)
-#define GET_NEXT_HEADER(p) (Header*)((char*)p + GET_SIZE(p));
+#define SET_PREV_FREE(p) (GET(p) |= 0x2)
+#define CLEAR_PREV_FREE(p) (GET(p) &= ~0x2)
+#define GET_NEXT_HEADER(p) (Header*)((char*)p + GET_SIZE(p))
+// free blocks repeat their size in a footer so the block on their
+// right can find their header
+#define SET_FOOTER(p) (GET(((Header*)((char*)p + GET_SIZE(p)) - 1)) = GET_SIZE(p))
+#define GET_PREV_HEADER(p) (Header*)((char*)p - GET_SIZE(((Header*)p - 1)))
+#define GET_LISTPOINTERS(p) (ListPointers *)((Header*)p + 1)
 
 // node for linked list comprises of a ptr to the header and
 // pointer to next node
@@ -32,14 +87,44 @@ typedef struct header {
     size_t sa_bit; // stores size and allocation status
 } Header;
 
+typedef struct pointers {
+    Header *prev;
+    Header *next;
+} ListPointers;
+
 // global variable for  start of linked list
 static void *segment_start;
 static size_t nused;
 static size_t segment_size;
 static Header *base; //start node
+static Header *heap_end; // terminating header past the last block
+#if BEST_FIT_INDEX
+static Header *buckets[NUM_BUCKETS];
+static unsigned long nonempty[BUCKET_WORDS]; // bit set if bucket non-empty
+#endif
+static char *committed; // segment committed up to here
+static char *dirty; // highest address the heap has written
+static HeapStats counters; // the call and search counts of myheap_stats
 
 //helper function header
-Header *find_best_header(Header** cur_head, size_t size);
+void *heap_malloc(size_t requested_size);
+void heap_free(void *ptr);
+void *heap_realloc(void *old_ptr, size_t new_size);
+void *heap_memalign(size_t align, size_t requested_size);
+size_t block_size(size_t requested_size);
+void allocate_block(Header *head, size_t total_size);
+void *allocate_at_end(size_t total_size);
+int stats_class(size_t size);
+Header *find_best_header(size_t size);
+void coalesce(Header *head);
+void index_add(Header *head);
+void index_remove(Header *head);
+bool extend_heap(char *limit);
+void trim_tail(Header *end);
+bool check_blocks(size_t *nfree);
+bool check_index(size_t nfree);
+bool heap_error(const char *msg, void *where);
+void sample_validate();
 
 // rounds up sz to closest multiple of mult
 size_t roundup(size_t sz, size_t mult) {
@@ -50,60 +135,278 @@ size_t roundup(size_t sz, size_t mult) {
 // initialization
 bool myinit(void *heap_start, size_t heap_size) {
 
-    if (heap_size < HEADER_SIZE) { 
+    if (heap_size < ALIGNMENT) { 
         return false;
     }
     
     segment_start = heap_start;
     segment_size = heap_size;
     nused = 0;
-    base = segment_start;
+    base = (Header *)((char *)segment_start + ALIGNMENT - HEADER_SIZE); // payloads land aligned
+    heap_end = base;
+    committed = dirty = segment_start;
+#if BEST_FIT_INDEX
+    memset(buckets, 0, sizeof(buckets));
+    memset(nonempty, 0, sizeof(nonempty));
+#endif
+    memset(&counters, 0, sizeof(counters));
+    if (!extend_heap((char *)base + HEADER_SIZE)) {
+        return false;
+    }
     (*base).sa_bit = 0; //clear heap by allowing overwrite
     return true;
 }
 
+// commits the segment up to limit, a chunk at a time, before the heap
+// writes there. Returns false if the OS refuses
+bool extend_heap(char *limit) {
+    if (limit > committed) {
+        char *segment_end = (char *)segment_start + segment_size;
+        char *new_committed = (char *)segment_start +
+            roundup(limit - (char *)segment_start, COMMIT_CHUNK);
+        if (new_committed > segment_end) {
+            new_committed = segment_end;
+        }
+        if (!heap_segment_commit(committed, new_committed - committed)) {
+            return false;
+        }
+        committed = new_committed;
+    }
+    if (limit > dirty) {
+        dirty = limit;
+    }
+    return true;
+}
+
+// hands the written pages past the terminating header back to the OS
+// once there are TRIM_THRESHOLD bytes of them
+void trim_tail(Header *end) {
+    char *clean = (char *)roundup((size_t)end + HEADER_SIZE, PAGE_SIZE);
+    if (dirty > clean && dirty - clean >= TRIM_THRESHOLD) {
+        heap_segment_release(clean, dirty - clean);
+        dirty = clean;
+    }
+}
+
+// total size of the block for a request: payload rounded up so the
+// next header keeps payloads aligned, at least MIN_BLOCK_SIZE
+size_t block_size(size_t requested_size) {
+    size_t total_size = roundup(requested_size + HEADER_SIZE, ALIGNMENT);
+    return (total_size < MIN_BLOCK_SIZE) ? MIN_BLOCK_SIZE : total_size; // must hold the free block fields later
+}
+
 // Malloc function that uses best fit to determine utilization of blocks. Implemented using a linked
 // list of structs containing a pointer to the header and apointer to  the next node
-void *mymalloc(size_t requested_size) {
-    size_t req_size = roundup(requested_size, ALIGNMENT);
-    size_t total_size = req_size  + HEADER_SIZE; // header is a multiple of alignment
-    Header *next_head_loc;
-    void *block;
-    Header *cur_head = base;
-    
+void *heap_malloc(size_t requested_size) {
     if (requested_size == 0 || requested_size > MAX_REQUEST_SIZE ||
-        (req_size + nused > segment_size)) {
+        (requested_size + nused > segment_size)) {
         return NULL;
     }
-    Header *best_blk_head = find_best_header(&cur_head, total_size);
+    size_t total_size = block_size(requested_size);
+    Header *best_blk_head = find_best_header(total_size);
     
     if (best_blk_head != NULL) { // usable block found
-        size_t best_blk_size = GET_SIZE(best_blk_head);
-        SET_USED(best_blk_head);
-        block = GET_MEMORY(best_blk_head);  //best_blk_head + 1;
-        nused += (best_blk_size - HEADER_SIZE);
-        return block;
-        
-    } else { // new allocation
-        size_t header = total_size + 1;
-        next_head_loc = GET_NEXT_HEADER(cur_head);
-        SET_HEADER(next_head_loc, header);
-        nused += total_size;
-        block = GET_MEMORY(next_head_loc);
-        return block;
+        index_remove(best_blk_head);
+        allocate_block(best_blk_head, total_size);
+        return GET_MEMORY(best_blk_head);  //best_blk_head + 1;
     }
-    return NULL;
+    return allocate_at_end(total_size); // new allocation
+}
+
+// marks a free block (already off the index) used, splitting off what
+// total_size leaves if that is big enough to be a block
+void allocate_block(Header *head, size_t total_size) {
+    size_t blk_size = GET_SIZE(head);
+    if (blk_size - total_size >= MIN_BLOCK_SIZE) { // split off the rest
+        SET_HEADER(head, total_size | GET_PREV_FREE(head));
+        Header *rest = GET_NEXT_HEADER(head);
+        SET_HEADER(rest, blk_size - total_size);
+        SET_FOOTER(rest); // right neighbour already has its prev free bit set
+        index_add(rest);
+    } else {
+        CLEAR_PREV_FREE(GET_NEXT_HEADER(head));
+    }
+    SET_USED(head);
+    nused += (GET_SIZE(head) - HEADER_SIZE);
+}
+
+// carves a block of total_size out of the unused tail at heap_end.
+// Returns NULL if the segment has no room left or can't be committed
+void *allocate_at_end(size_t total_size) {
+    Header *next_head_loc = heap_end;
+    size_t header = total_size + 1 + GET_PREV_FREE(heap_end);
+    if ((char *)next_head_loc + total_size + HEADER_SIZE >
+        (char *)segment_start + segment_size) { // no room left in segment
+        return NULL;
+    }
+    if (!extend_heap((char *)next_head_loc + total_size + HEADER_SIZE)) {
+        return NULL;
+    }
+    SET_HEADER(next_head_loc, header);
+    heap_end = GET_NEXT_HEADER(next_head_loc);
+    SET_HEADER(heap_end, 0); // new end of heap
+    nused += total_size - HEADER_SIZE;
+    return GET_MEMORY(next_head_loc);
+}
+
+// allocates a block whose payload starts on a multiple of align (a power
+// of two above ALIGNMENT): the best free block that holds it at any
+// offset, or else the tail. The slack in front becomes a free block of
+// its own, so it must be empty or at least MIN_BLOCK_SIZE
+void *heap_memalign(size_t align, size_t requested_size) {
+    if (requested_size == 0 || requested_size > MAX_REQUEST_SIZE ||
+        (requested_size + nused > segment_size)) {
+        return NULL;
+    }
+    size_t total_size = block_size(requested_size);
+    Header *head = find_best_header(total_size + align + MIN_BLOCK_SIZE);
+    bool at_end = (head == NULL);
+    if (at_end) {
+        head = heap_end;
+    }
+    char *payload = (char *)roundup((size_t)(GET_MEMORY(head)), align);
+    size_t lead = payload - (char *)(GET_MEMORY(head));
+    if (lead != 0 && lead < MIN_BLOCK_SIZE) { // slack must be a block of its own
+        payload += roundup(MIN_BLOCK_SIZE - lead, align);
+        lead = payload - (char *)(GET_MEMORY(head));
+    }
+    if (at_end) { // make sure the tail holds it before touching anything
+        if (payload + total_size > (char *)segment_start + segment_size ||
+            !extend_heap(payload + total_size)) {
+            return NULL;
+        }
+    } else {
+        index_remove(head);
+    }
+    if (lead > 0) { // split off the slack and free it
+        size_t blk_size = GET_SIZE(head);
+        SET_HEADER(head, lead | GET_PREV_FREE(head));
+        SET_FOOTER(head);
+        index_add(head);
+        head = (Header *)((char *)head + lead);
+        SET_HEADER(head, (at_end ? 0 : blk_size - lead) | 0x2);
+        if (at_end) {
+            heap_end = head;
+        }
+    }
+    if (at_end) {
+        return allocate_at_end(total_size);
+    }
+    allocate_block(head, total_size);
+    return GET_MEMORY(head);
+}
+
+#if BEST_FIT_INDEX
+
+// returns the bucket of a free block of the given size: exact below
+// EXACT_MAX_SIZE, then the top SUB_BITS bits below the leading one
+int bucket_of(size_t size) {
+    if (size <= EXACT_MAX_SIZE) {
+        return (size - MIN_BLOCK_SIZE) / ALIGNMENT;
+    }
+    int shift = (int)(sizeof(long) * 8 - 1) - __builtin_clzl(size);
+    int bucket = EXACT_BUCKETS + (shift - FIRST_RANGE_SHIFT) * SUB_BUCKETS +
+        (int)((size >> (shift - SUB_BITS)) & (SUB_BUCKETS - 1));
+    return (bucket < NUM_BUCKETS) ? bucket : NUM_BUCKETS - 1;
+}
+
+// pushes a free block onto its bucket's list
+void index_add(Header *head) {
+    int bucket = bucket_of(GET_SIZE(head));
+    ListPointers *lp = GET_LISTPOINTERS(head);
+    lp->prev = NULL;
+    lp->next = buckets[bucket];
+    if (lp->next) {
+        (GET_LISTPOINTERS(lp->next))->prev = head;
+    }
+    buckets[bucket] = head;
+    nonempty[bucket / 64] |= 1UL << (bucket % 64);
+}
+
+// unlinks a free block from its bucket. Must be called before the
+// block's header size changes
+void index_remove(Header *head) {
+    int bucket = bucket_of(GET_SIZE(head));
+    ListPointers *lp = GET_LISTPOINTERS(head);
+    if (lp->prev) {
+        (GET_LISTPOINTERS(lp->prev))->next = lp->next;
+    } else {
+        buckets[bucket] = lp->next;
+        if (!lp->next) {
+            nonempty[bucket / 64] &= ~(1UL << (bucket % 64));
+        }
+    }
+    if (lp->next) {
+        (GET_LISTPOINTERS(lp->next))->prev = lp->prev;
+    }
+}
+
+// returns the smallest block of at least total_size on a bucket's list,
+// or NULL if none fits. Blocks in an exact bucket all have the same size.
+// Adds the blocks it looked at to *searched
+Header *best_in_bucket(int bucket, size_t total_size, size_t *searched) {
+    Header *best_blk_head = NULL;
+    size_t best_blk_size = 0;
+    
+    for (Header *cur = buckets[bucket]; cur; cur = (GET_LISTPOINTERS(cur))->next) {
+        size_t cur_blk_size = GET_SIZE(cur);
+        (*searched)++;
+        if (cur_blk_size >= total_size && (!best_blk_head || cur_blk_size < best_blk_size)) {
+            best_blk_head = cur;
+            best_blk_size = cur_blk_size;
+            if (bucket < EXACT_BUCKETS || cur_blk_size == total_size) {
+                break;
+            }
+        }
+    }
+    return best_blk_head;
+}
+
+// function that searches for the free block with the least space to
+// spare that holds total_size (best fit): the smallest fitting block in
+// the size's own bucket, else the smallest in the first non-empty bucket
+// above it, where every block fits. Returns NULL if no free block fits
+Header *find_best_header(size_t total_size) {
+    int stats_cls = stats_class(total_size - HEADER_SIZE);
+    size_t *searched = &counters.searched[stats_cls];
+    int bucket = bucket_of(total_size);
+    counters.searches[stats_cls]++;
+    Header *best_blk_head = best_in_bucket(bucket, total_size, searched);
+    if (best_blk_head || bucket == NUM_BUCKETS - 1) {
+        return best_blk_head;
+    }
+    bucket++;
+    int word = bucket / 64;
+    unsigned long bits = nonempty[word] & (~0UL << (bucket % 64));
+    while (!bits) {
+        if (++word == BUCKET_WORDS) {
+            return NULL;
+        }
+        bits = nonempty[word];
+    }
+    return best_in_bucket(word * 64 + __builtin_ctzl(bits), total_size, searched);
+}
+
+#else
+
+void index_add(Header *head) {
+}
+
+void index_remove(Header *head) {
 }
 
 // function that searches for a free, usable block of at least
 // total_size using best-fit algorithm (block with lowest amt of enough free space)
-Header *find_best_header(Header** cur_head_ad, size_t total_size) {
+Header *find_best_header(size_t total_size) {
     size_t best_blk_size = segment_size; //set to some max value
     Header *best_blk_head = NULL; 
-    Header *cur_head = *cur_head_ad;
-    size_t cur_blk_size = GET_SIZE(*cur_head_ad);
+    Header *cur_head = base;
+    size_t cur_blk_size = GET_SIZE(cur_head);
+    int stats_cls = stats_class(total_size - HEADER_SIZE);
     
+    counters.searches[stats_cls]++;
     while(cur_blk_size != 0) { // search all blocks
+        counters.searched[stats_cls]++;
         if(cur_blk_size >= total_size && !GET_USED(cur_head)) {
             if((cur_blk_size < best_blk_size) || (best_blk_head == NULL)) {
                 best_blk_head = cur_head;
@@ -113,34 +416,65 @@ Header *find_best_header(Header** cur_head_ad, size_t total_size) {
         cur_head = GET_NEXT_HEADER(cur_head);
         cur_blk_size = GET_SIZE(cur_head);
     }
-    *cur_head_ad = cur_head; // make sure current node in mymalloc is updated
     return best_blk_head;
 }
+
+#endif
     
 // this function "frees"  memory by clearing the lowest bit in the header (where use of
 // block  is stored) for future resuse
-void myfree(void *ptr) {
+void heap_free(void *ptr) {
     if (ptr == NULL) {
         return;
     }
     Header* head = GET_HEADER(ptr);
     SET_UNUSED(head);
     nused -= (GET_SIZE(head) - HEADER_SIZE);   
+    coalesce(head);
 }
 
-// myrealloc moves memory to new location with the new size and copies
+// merges a newly freed block with free neighbours on both sides. A free
+// block that reaches the end of the heap is handed back to the unused
+// tail by turning it into the terminating header
+void coalesce(Header *head) {
+    size_t size = GET_SIZE(head);
+    Header *next_head = GET_NEXT_HEADER(head);
+    
+    if (GET_SIZE(next_head) && !GET_USED(next_head)) {
+        index_remove(next_head);
+        size += GET_SIZE(next_head);
+    }
+    if (GET_PREV_FREE(head)) {
+        head = GET_PREV_HEADER(head);
+        index_remove(head);
+        size += GET_SIZE(head);
+    }
+    SET_HEADER(head, size);
+    next_head = GET_NEXT_HEADER(head);
+    if (GET_SIZE(next_head) == 0) { // last block: becomes end of heap
+        SET_HEADER(head, 0);
+        heap_end = head;
+        trim_tail(head);
+    } else {
+        SET_FOOTER(head);
+        SET_PREV_FREE(next_head);
+        index_add(head);
+    }
+}
+
+// heap_realloc moves memory to new location with the new size and copies
 // over data from old pointer and frees the old_ptr
-void *myrealloc(void *old_ptr, size_t new_size) {
+void *heap_realloc(void *old_ptr, size_t new_size) {
     
     if (old_ptr == NULL) {
-        return mymalloc(new_size); //nothing to copy over
+        return heap_malloc(new_size); //nothing to copy over
         
     } else if (old_ptr != NULL && new_size == 0) { 
-        myfree(old_ptr);
+        heap_free(old_ptr);
     } else {
         Header *old_head = GET_HEADER(old_ptr);
-        size_t old_size = GET_SIZE(old_head);
-        void *new_ptr = mymalloc(new_size); // updating of new header done in malloc
+        size_t old_size = GET_SIZE(old_head) - HEADER_SIZE;
+        void *new_ptr = heap_malloc(new_size); // updating of new header done in malloc
         if (new_ptr == NULL) { //realloc failed
             return NULL;
         }
@@ -148,25 +482,287 @@ void *myrealloc(void *old_ptr, size_t new_size) {
             old_size = new_size;
         }
         memcpy(new_ptr, old_ptr, old_size);
-        myfree(old_ptr);
+        heap_free(old_ptr);
         return new_ptr;
     }
     return NULL;
 }
 
+// returns the histogram class of a size: floor(log2(size)), with the
+// last class taking everything larger
+int stats_class(size_t size) {
+    if (size == 0) {
+        return 0;
+    }
+    int cls = (int)(sizeof(long) * 8 - 1) - __builtin_clzl(size);
+    return (cls < STATS_CLASSES) ? cls : STATS_CLASSES - 1;
+}
+
+// mymalloc, myrealloc and myfree count each successful call on top of
+// the heap routines; live bytes are the heap's own count of payload in
+// used blocks
+void *mymalloc(size_t requested_size) {
+    void *block = heap_malloc(requested_size);
+    if (block) {
+        counters.mallocs++;
+        counters.allocs[stats_class(requested_size)]++;
+        if (nused > counters.peak_bytes) {
+            counters.peak_bytes = nused;
+        }
+    }
+    SAMPLE_VALIDATE();
+    return block;
+}
+
+// mymalloc, then clears the block: this heap keeps no record of which
+// memory is still zero
+void *mycalloc(size_t count, size_t size) {
+    size_t requested_size;
+    if (__builtin_mul_overflow(count, size, &requested_size)) {
+        return NULL;
+    }
+    void *block = mymalloc(requested_size);
+    if (block) {
+        memset(block, 0, requested_size);
+    }
+    return block;
+}
+
+void myfree(void *ptr) {
+    if (ptr) {
+        counters.frees++;
+    }
+    heap_free(ptr);
+    SAMPLE_VALIDATE();
+}
+
+// a realloc to size 0 frees the block and counts as a realloc
+void *myrealloc(void *old_ptr, size_t new_size) {
+    void *block = heap_realloc(old_ptr, new_size);
+    if (block || (old_ptr && new_size == 0)) {
+        counters.reallocs++;
+        if (nused > counters.peak_bytes) {
+            counters.peak_bytes = nused;
+        }
+    }
+    SAMPLE_VALIDATE();
+    return block;
+}
+
+// allocates a block whose address is a multiple of align, a power of
+// two; counted as a malloc. Returns NULL for any other align
+void *mymemalign(size_t align, size_t requested_size) {
+    if (align == 0 || (align & (align - 1)) != 0) {
+        return NULL;
+    }
+    if (align <= ALIGNMENT) {
+        return mymalloc(requested_size);
+    }
+    void *block = heap_memalign(align, requested_size);
+    if (block) {
+        counters.mallocs++;
+        counters.allocs[stats_class(requested_size)]++;
+        if (nused > counters.peak_bytes) {
+            counters.peak_bytes = nused;
+        }
+    }
+    SAMPLE_VALIDATE();
+    return block;
+}
+
+size_t myusable_size(void *ptr) {
+    if (ptr == NULL) {
+        return 0;
+    }
+    Header *head = GET_HEADER(ptr);
+    return GET_SIZE(head) - HEADER_SIZE;
+}
+
+// copies the counters and walks the heap for its free blocks. Returns
+// false if the heap has not been initialized
+bool myheap_stats(HeapStats *stats) {
+    if (!base) {
+        return false;
+    }
+    *stats = counters;
+    stats->live_bytes = nused;
+    stats->heap_bytes = (char *)heap_end - (char *)base;
+    for (Header *cur = base; GET_SIZE(cur); cur = GET_NEXT_HEADER(cur)) {
+        size_t size = GET_SIZE(cur);
+        if (!GET_USED(cur)) {
+            stats->free_bytes += size;
+            stats->free_blocks[stats_class(size)]++;
+            if (size > stats->largest_free) {
+                stats->largest_free = size;
+            }
+        }
+    }
+    if (stats->free_bytes > 0) {
+        stats->fragmentation = 1.0 - (double)stats->largest_free / stats->free_bytes;
+    }
+    return true;
+}
+
+// prints the statistics, then a row per size class that has seen any
+// allocation or search or holds a free block
+void myheap_dump_stats(FILE *fp) {
+    HeapStats stats;
+    if (!myheap_stats(&stats)) {
+        fprintf(fp, "heap not initialized\n");
+        return;
+    }
+    size_t nfree = 0;
+    for (int i = 0; i < STATS_CLASSES; i++) {
+        nfree += stats.free_blocks[i];
+    }
+    fprintf(fp, "live bytes     %zu (peak %zu)\n", stats.live_bytes, stats.peak_bytes);
+    fprintf(fp, "heap bytes     %zu, %zu free in %zu blocks, largest %zu\n",
+            stats.heap_bytes, stats.free_bytes, nfree, stats.largest_free);
+    fprintf(fp, "fragmentation  %.1f%%\n", 100.0 * stats.fragmentation);
+    fprintf(fp, "calls          %zu malloc, %zu realloc, %zu free\n",
+            stats.mallocs, stats.reallocs, stats.frees);
+    fprintf(fp, "%-22s %10s %10s %8s %11s\n", "size", "allocs", "searches", "avg len", "free blocks");
+    for (int i = 0; i < STATS_CLASSES; i++) {
+        if (!stats.allocs[i] && !stats.searches[i] && !stats.free_blocks[i]) {
+            continue;
+        }
+        char range[32];
+        if (i == STATS_CLASSES - 1) {
+            snprintf(range, sizeof(range), "%lu+", 1UL << i);
+        } else {
+            snprintf(range, sizeof(range), "%lu-%lu", i ? 1UL << i : 0, (2UL << i) - 1);
+        }
+        fprintf(fp, "%-22s %10zu %10zu %8.1f %11zu\n", range, stats.allocs[i], stats.searches[i],
+                stats.searches[i] ? (double)stats.searched[i] / stats.searches[i] : 0.0,
+                stats.free_blocks[i]);
+    }
+}
+
+// checks the heap in one walk of its blocks plus one of the best-fit
+// index. Returns false at the first problem, having printed it to stderr
 bool validate_heap() {
+    size_t nfree = 0;
   
     if(!base)  {
         return false;
     }
     // print_heap();
+    return check_blocks(&nfree) && check_index(nfree);
+}
+
+// walks the blocks from base to heap_end, checking that each is aligned
+// and sized to stay inside the segment, that its prev free bit tells the
+// truth, that no two free blocks touch and none is left before the end,
+// and that free blocks keep their footer. Counts the free blocks into
+// *nfree and checks the used ones against nused
+bool check_blocks(size_t *nfree) {
+    char *segment_end = (char *)segment_start + segment_size;
+    size_t used = 0;
+    bool prev_free = false;
+    Header *cur = base;
+    
+    for (; cur != heap_end; cur = GET_NEXT_HEADER(cur)) {
+        size_t size = GET_SIZE(cur);
+        if ((char *)cur < (char *)base || (char *)cur + HEADER_SIZE > segment_end) {
+            return heap_error("block outside the segment", cur);
+        }
+        if (((unsigned long)(GET_MEMORY(cur)) & (ALIGNMENT - 1)) != 0 || size % ALIGNMENT != 0) {
+            return heap_error("misaligned block", cur);
+        }
+        if (size < MIN_BLOCK_SIZE || size > (size_t)((char *)heap_end - (char *)cur)) {
+            return heap_error("bad block size", cur);
+        }
+        if (!GET_PREV_FREE(cur) != !prev_free) {
+            return heap_error("prev free bit wrong", cur);
+        }
+        bool is_free = !GET_USED(cur);
+        if (is_free && prev_free) {
+            return heap_error("free neighbours not coalesced", cur);
+        }
+        if (is_free) {
+            Header *footer = (Header *)((char *)cur + size) - 1;
+            if (GET(footer) != size) {
+                return heap_error("footer does not match header", cur);
+            }
+            (*nfree)++;
+        } else {
+            used += size - HEADER_SIZE;
+        }
+        prev_free = is_free;
+    }
+    if (GET(heap_end) != 0 || prev_free) {
+        return heap_error("heap does not end in a used block and the end header", heap_end);
+    }
+    if (used != nused) {
+        return heap_error("nused does not match the used blocks", base);
+    }
     return true;
 }
 
-// prints entire heap from segment_start address
+#if BEST_FIT_INDEX
+// walks each bucket, checking that its blocks are free blocks of the
+// heap in the right bucket and that every prev link mirrors the next
+// link that led there, and that the non-empty bitmap agrees. With the
+// links symmetric no block can be reached twice, so nfree blocks
+// indexed means each free block is in exactly one bucket
+bool check_index(size_t nfree) {
+    size_t indexed = 0;
+    
+    for (int bucket = 0; bucket < NUM_BUCKETS; bucket++) {
+        Header *prev = NULL;
+        if (!buckets[bucket] != !(nonempty[bucket / 64] & (1UL << (bucket % 64)))) {
+            return heap_error("non-empty bucket bitmap wrong", buckets[bucket]);
+        }
+        for (Header *cur = buckets[bucket]; cur; prev = cur, cur = (GET_LISTPOINTERS(cur))->next) {
+            if ((char *)cur < (char *)base || (char *)cur >= (char *)heap_end) {
+                return heap_error("indexed block outside the heap", cur);
+            }
+            if (GET_USED(cur) || bucket_of(GET_SIZE(cur)) != bucket) {
+                return heap_error("indexed block used or in the wrong bucket", cur);
+            }
+            if ((GET_LISTPOINTERS(cur))->prev != prev) {
+                return heap_error("prev link does not match", cur);
+            }
+            if (++indexed > nfree) {
+                return heap_error("more blocks indexed than free", cur);
+            }
+        }
+    }
+    if (indexed != nfree) {
+        return heap_error("free block missing from the index", base);
+    }
+    return true;
+}
+#else
+bool check_index(size_t nfree) {
+    return true;
+}
+#endif
+
+// reports a problem validate_heap found, stopping in the debugger if
+// there is one. Returns false for the check to pass on
+bool heap_error(const char *msg, void *where) {
+    fprintf(stderr, "validate_heap: %s at %p\n", msg, where);
+    breakpoint();
+    return false;
+}
+
+// Built with -DVALIDATE_RATE=n, every n-th call of the public functions
+// runs validate_heap when it is done and aborts if the heap is broken
+#if VALIDATE_RATE > 0
+void sample_validate() {
+    static unsigned long ncalls;
+    if (++ncalls % VALIDATE_RATE == 0 && !validate_heap()) {
+        fprintf(stderr, "heap broken after call %lu\n", ncalls);
+        abort();
+    }
+}
+#endif
+
+// prints entire heap from the first block
 // prints address and header information
 void print_heap() {
-    Header *cur = segment_start;
+    Header *cur = base;
     printf("Print entire heap: \n");
    
     while(GET_SIZE(cur)) {
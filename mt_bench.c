@@ -0,0 +1,126 @@
+/* File: mt_bench.c
+ * ----------------
+ * Multi-threaded throughput benchmark for the thread-safe explicit
+ * allocator. For 1..max_threads threads, every thread runs the same
+ * random mix of small mymalloc/myfree calls over its own window of live
+ * blocks, and a share of the frees is handed to the neighbouring thread
+ * so that cross-thread frees are exercised. Prints total operations per
+ * second for each thread count, then the usage of each arena.
+ *
+ * usage: mt_bench [-t max_threads] [-n ops_per_thread] [-s max_size] [-r remote_percent]
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "allocator.h"
+#include "segment.h"
+
+#define HEAP_SIZE (1L << 32)
+#define WINDOW 1024 // live blocks per thread
+#define MAX_BENCH_THREADS 256
+
+static long ops_per_thread = 2000000;
+static size_t max_size = 256;
+static int remote_percent = 10;
+static int nthreads;
+static void *mailbox[MAX_BENCH_THREADS]; // one slot per thread, swapped atomically
+
+// xorshift generator, kept per thread so threads don't share state
+static unsigned long next_rand(unsigned long *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+static void *worker(void *arg) {
+    long id = (long)arg;
+    unsigned long rng = 88172645463325252UL + id;
+    void *live[WINDOW] = {0};
+    
+    for (long i = 0; i < ops_per_thread; i++) {
+        int slot = next_rand(&rng) % WINDOW;
+        if (!live[slot]) {
+            live[slot] = mymalloc(next_rand(&rng) % max_size + 1);
+            *(char *)live[slot] = 1; // touch the block like a real caller
+        } else if ((int)(next_rand(&rng) % 100) < remote_percent) {
+            void **box = &mailbox[(id + 1) % nthreads];
+            void *other = __atomic_exchange_n(box, live[slot], __ATOMIC_ACQ_REL);
+            myfree(other); // block allocated by a neighbour (or NULL)
+            live[slot] = NULL;
+        } else {
+            myfree(live[slot]);
+            live[slot] = NULL;
+        }
+    }
+    for (int slot = 0; slot < WINDOW; slot++) {
+        myfree(live[slot]);
+    }
+    return NULL;
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char *argv[]) {
+    int max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    int opt;
+    
+    while ((opt = getopt(argc, argv, "t:n:s:r:")) != -1) {
+        switch (opt) {
+            case 't': max_threads = atoi(optarg); break;
+            case 'n': ops_per_thread = atol(optarg); break;
+            case 's': max_size = atol(optarg); break;
+            case 'r': remote_percent = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-t max_threads] [-n ops_per_thread] [-s max_size] [-r remote_percent]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (max_threads < 1 || max_threads > MAX_BENCH_THREADS || max_size < 1) {
+        fprintf(stderr, "bad arguments\n");
+        return 1;
+    }
+    if (!init_heap_segment(HEAP_SIZE) || !myinit(heap_segment_start(), heap_segment_size())) {
+        fprintf(stderr, "heap initialization failed\n");
+        return 1;
+    }
+    
+    printf("threads     Mops/s   speedup\n");
+    double base = 0;
+    for (nthreads = 1; nthreads <= max_threads; nthreads++) {
+        pthread_t threads[MAX_BENCH_THREADS];
+        double start = now();
+        for (long i = 0; i < nthreads; i++) {
+            pthread_create(&threads[i], NULL, worker, (void *)i);
+        }
+        for (int i = 0; i < nthreads; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        double mops = nthreads * ops_per_thread / (now() - start) / 1e6;
+        for (int i = 0; i < nthreads; i++) {
+            myfree(mailbox[i]);
+            mailbox[i] = NULL;
+        }
+        if (nthreads == 1) {
+            base = mops;
+        }
+        printf("%7d %10.2f %8.2fx\n", nthreads, mops, mops / base);
+    }
+    
+    printf("\narena  threads   heap MiB   used KiB   free blocks\n");
+    for (int i = 0; i < myarena_count(); i++) {
+        ArenaUsage usage;
+        myarena_usage(i, &usage);
+        printf("%5d %8d %10zu %10zu %13zu\n", i, usage.threads, usage.heap_size >> 20,
+               usage.bytes_used >> 10, usage.free_blocks);
+    }
+    return validate_heap() ? 0 : 1;
+}
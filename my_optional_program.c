@@ -9,7 +9,7 @@
 #include "allocator.h"
 #include "segment.h"
 
-#define HEAP_SIZE 1L << 32
+#define HEAP_SIZE 1L << 32 // only reserved: the allocator commits what it uses
 
 bool initialize_heap_allocator() {
     init_heap_segment(HEAP_SIZE);
@@ -0,0 +1,155 @@
+/* File: pc_bench.c
+ * ----------------
+ * Producer/consumer benchmark for the thread-safe explicit allocator,
+ * the pattern of a pipeline where one thread allocates messages and
+ * another frees them. For 1..max_pairs pairs, each producer mallocs
+ * messages of random size, fills in their first bytes and passes them
+ * through a ring to its consumer, which checks and frees them, so every
+ * free is a cross-thread free. Prints messages per second for each pair
+ * count, and how often a thread blocked (voluntary context switches,
+ * mostly waits for a lock another thread holds, per 1000 messages), then
+ * the usage of each arena.
+ *
+ * usage: pc_bench [-p max_pairs] [-n messages_per_producer] [-s min_size:max_size]
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+#include "allocator.h"
+#include "segment.h"
+
+#define HEAP_SIZE (1L << 32)
+#define RING_SIZE 1024 // messages in flight per pair, a power of two
+#define MAX_PAIRS 64
+
+typedef struct {
+    void *slots[RING_SIZE];
+    char pad1[64];
+    unsigned long head; // next slot the producer fills
+    char pad2[64];
+    unsigned long tail; // next slot the consumer empties
+    char pad3[64];
+} Ring;
+
+static long messages = 1000000;
+static size_t min_size = 32, max_size = 2048;
+static Ring rings[MAX_PAIRS];
+
+// xorshift generator, kept per thread so threads don't share state
+static unsigned long next_rand(unsigned long *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+static void *producer(void *arg) {
+    Ring *ring = arg;
+    unsigned long rng = 88172645463325252UL + (ring - rings);
+
+    for (long i = 0; i < messages; i++) {
+        size_t size = min_size + next_rand(&rng) % (max_size - min_size + 1);
+        long *msg = mymalloc(size);
+        if (msg == NULL) {
+            fprintf(stderr, "heap full\n");
+            exit(1);
+        }
+        msg[0] = i; // a message carries at least its sequence number
+        while (ring->head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == RING_SIZE) {
+            sched_yield(); // ring full: let the consumer catch up
+        }
+        ring->slots[ring->head % RING_SIZE] = msg;
+        __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+static void *consumer(void *arg) {
+    Ring *ring = arg;
+
+    for (long i = 0; i < messages; i++) {
+        while (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == ring->tail) {
+            sched_yield(); // ring empty: let the producer catch up
+        }
+        long *msg = ring->slots[ring->tail % RING_SIZE];
+        if (msg[0] != i) {
+            fprintf(stderr, "message %ld arrived as %ld\n", i, msg[0]);
+            exit(1);
+        }
+        myfree(msg);
+        __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char *argv[]) {
+    int max_pairs = sysconf(_SC_NPROCESSORS_ONLN) / 2;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:n:s:")) != -1) {
+        switch (opt) {
+            case 'p': max_pairs = atoi(optarg); break;
+            case 'n': messages = atol(optarg); break;
+            case 's': sscanf(optarg, "%zu:%zu", &min_size, &max_size); break;
+            default:
+                fprintf(stderr, "usage: %s [-p max_pairs] [-n messages_per_producer] [-s min_size:max_size]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (max_pairs < 1) {
+        max_pairs = 1;
+    }
+    if (max_pairs > MAX_PAIRS || messages < 1 || min_size < sizeof(long) || max_size < min_size) {
+        fprintf(stderr, "bad arguments\n");
+        return 1;
+    }
+    if (!init_heap_segment(HEAP_SIZE) || !myinit(heap_segment_start(), heap_segment_size())) {
+        fprintf(stderr, "heap initialization failed\n");
+        return 1;
+    }
+
+    printf("pairs   Mmsg/s   speedup   blocked/1000\n");
+    double base = 0;
+    for (int npairs = 1; npairs <= max_pairs; npairs++) {
+        pthread_t threads[2 * MAX_PAIRS];
+        memset(rings, 0, sizeof(rings));
+        struct rusage before, after;
+        getrusage(RUSAGE_SELF, &before);
+        double start = now();
+        for (int i = 0; i < npairs; i++) {
+            pthread_create(&threads[2 * i], NULL, producer, &rings[i]);
+            pthread_create(&threads[2 * i + 1], NULL, consumer, &rings[i]);
+        }
+        for (int i = 0; i < 2 * npairs; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        double mmsgs = npairs * messages / (now() - start) / 1e6;
+        getrusage(RUSAGE_SELF, &after);
+        double blocked = (after.ru_nvcsw - before.ru_nvcsw) * 1000.0 / (npairs * messages);
+        if (npairs == 1) {
+            base = mmsgs;
+        }
+        printf("%5d %8.2f %8.2fx %14.2f\n", npairs, mmsgs, mmsgs / base, blocked);
+    }
+
+    printf("\narena  threads   heap MiB   used KiB   free blocks\n");
+    for (int i = 0; i < myarena_count(); i++) {
+        ArenaUsage usage;
+        myarena_usage(i, &usage);
+        printf("%5d %8d %10zu %10zu %13zu\n", i, usage.threads, usage.heap_size >> 20,
+               usage.bytes_used >> 10, usage.free_blocks);
+    }
+    return validate_heap() ? 0 : 1;
+}
@@ -0,0 +1,184 @@
+/* File: region.c
+ * --------------
+ * Region allocator on top of mymalloc (see region.h). Each region carves
+ * its current chunk from next up to limit, like the bump allocator
+ * carves the heap; a request that doesn't fit starts a new chunk and
+ * abandons the rest of the old one. Requests over a quarter of a chunk
+ * get a chunk of their own on a separate list, so they neither waste a
+ * chunk's tail nor leave one half used. Chunks of either list are linked
+ * newest first, so a savepoint is just the heads of both lists and the
+ * bump pointer, and restoring frees chunks until the heads match again.
+ *
+ * Child regions are listed newest first under their parent and numbered
+ * in order of creation, so a savepoint restores children by number and
+ * stays valid when a child is destroyed on its own.
+ *
+ * The functions below are static, as this file is linked next to an
+ * allocator whose helpers are not.
+ */
+
+#include "allocator.h"
+#include "region.h"
+#include <string.h>
+
+#define DEFAULT_CHUNK_SIZE (64L << 10)
+#define MIN_CHUNK_SIZE 256
+
+typedef struct Chunk {
+    struct Chunk *prev; // next older chunk of the same list
+    size_t size;        // bytes obtained from mymalloc, this header included
+} Chunk;               // 16 bytes, so the memory after it keeps ALIGNMENT
+
+struct Region {
+    Chunk *chunk;           // chunk being carved, newest first
+    char *next, *limit;     // free part of it
+    Chunk *big;             // chunks holding one big request, newest first
+    Chunk *spare;           // released chunk kept for the next one needed
+    size_t chunk_size;
+    size_t size;            // bytes held from mymalloc, spare included
+    Region *parent;
+    Region *children;       // newest first
+    Region *prev_sibling, *next_sibling; // newer and older siblings
+    unsigned long serial;   // position among the parent's children
+    unsigned long next_serial;
+};
+
+// rounds up sz to a multiple of ALIGNMENT
+static size_t align_up(size_t sz) {
+    return (sz + ALIGNMENT - 1) & ~(ALIGNMENT - 1UL);
+}
+
+// returns a chunk of size bytes, the spare one if it fits
+static Chunk *new_chunk(Region *region, size_t size) {
+    Chunk *chunk = region->spare;
+    if (chunk && chunk->size == size) {
+        region->spare = NULL;
+        return chunk;
+    }
+    chunk = mymalloc(size);
+    if (chunk) {
+        chunk->size = size;
+        region->size += size;
+    }
+    return chunk;
+}
+
+// keeps a normal chunk as the spare if there is none yet, so a region
+// bouncing across a chunk boundary doesn't call mymalloc every time
+static void release_chunk(Region *region, Chunk *chunk) {
+    if (!region->spare && chunk->size == region->chunk_size) {
+        region->spare = chunk;
+        return;
+    }
+    region->size -= chunk->size;
+    myfree(chunk);
+}
+
+// destroys the children created at or after serial
+static void destroy_children(Region *region, unsigned long serial) {
+    while (region->children && region->children->serial >= serial) {
+        region_destroy(region->children);
+    }
+}
+
+Region *region_create(Region *parent, size_t chunk_size) {
+    Region *region = mymalloc(sizeof(Region));
+    if (region == NULL) {
+        return NULL;
+    }
+    memset(region, 0, sizeof(Region));
+    if (chunk_size == 0) {
+        chunk_size = DEFAULT_CHUNK_SIZE;
+    }
+    region->chunk_size = align_up(chunk_size < MIN_CHUNK_SIZE ? MIN_CHUNK_SIZE : chunk_size);
+    if (parent) {
+        region->parent = parent;
+        region->serial = parent->next_serial++;
+        region->next_sibling = parent->children;
+        if (parent->children) {
+            parent->children->prev_sibling = region;
+        }
+        parent->children = region;
+    }
+    return region;
+}
+
+void *region_alloc(Region *region, size_t size) {
+    if (size == 0 || size > MAX_REQUEST_SIZE) {
+        return NULL;
+    }
+    size = align_up(size);
+    if (size > (size_t)(region->limit - region->next)) {
+        if (size > region->chunk_size / 4) {
+            Chunk *chunk = new_chunk(region, sizeof(Chunk) + size);
+            if (chunk == NULL) {
+                return NULL;
+            }
+            chunk->prev = region->big;
+            region->big = chunk;
+            return chunk + 1;
+        }
+        Chunk *chunk = new_chunk(region, region->chunk_size);
+        if (chunk == NULL) {
+            return NULL;
+        }
+        chunk->prev = region->chunk;
+        region->chunk = chunk;
+        region->next = (char *)(chunk + 1);
+        region->limit = (char *)chunk + chunk->size;
+    }
+    void *ptr = region->next;
+    region->next += size;
+    return ptr;
+}
+
+RegionMark region_save(Region *region) {
+    RegionMark mark = { region->chunk, region->next, region->big, region->next_serial };
+    return mark;
+}
+
+void region_restore(Region *region, RegionMark mark) {
+    destroy_children(region, mark.serial);
+    while (region->big != mark.big) {
+        Chunk *chunk = region->big;
+        region->big = chunk->prev;
+        release_chunk(region, chunk);
+    }
+    while (region->chunk != mark.chunk) {
+        Chunk *chunk = region->chunk;
+        region->chunk = chunk->prev;
+        release_chunk(region, chunk);
+    }
+    region->next = mark.next;
+    region->limit = region->chunk ? (char *)region->chunk + region->chunk->size : NULL;
+}
+
+// restoring to the empty state releases every chunk, and the first
+// normal one released stays behind as the spare
+void region_reset(Region *region) {
+    RegionMark empty = { NULL, NULL, NULL, 0 };
+    region_restore(region, empty);
+}
+
+void region_destroy(Region *region) {
+    region_reset(region);
+    if (region->spare) {
+        myfree(region->spare);
+    }
+    Region *parent = region->parent;
+    if (parent) {
+        if (region->prev_sibling) {
+            region->prev_sibling->next_sibling = region->next_sibling;
+        } else {
+            parent->children = region->next_sibling;
+        }
+        if (region->next_sibling) {
+            region->next_sibling->prev_sibling = region->prev_sibling;
+        }
+    }
+    myfree(region);
+}
+
+size_t region_size(Region *region) {
+    return region->size;
+}
@@ -0,0 +1,77 @@
+/* File: region.h
+ * --------------
+ * Region allocator for memory that lives and dies together, such as
+ * everything allocated while serving one request. A region bump
+ * allocates out of chunks it gets from mymalloc, and gives everything
+ * back at once: there is no per-object free. It runs on top of whichever
+ * allocator it is linked with, next to that allocator's own blocks.
+ *
+ * Regions nest: a region created with a parent is destroyed along with
+ * it, and by any reset or restore of the parent that reaches back past
+ * its creation. A savepoint records the state of a region so that a
+ * later restore releases only what came after it. Regions are not
+ * thread-safe; use one per thread (or per request).
+ */
+
+#ifndef _REGION_H_
+#define _REGION_H_
+#include <stddef.h> // for size_t
+
+typedef struct Region Region;
+
+typedef struct {
+    void *chunk;           // chunk being carved at the time
+    char *next;            // first free byte in it
+    void *big;             // newest big allocation
+    unsigned long serial;  // children created after this go on restore
+} RegionMark;
+
+
+/* Function: region_create
+ * -----------------------
+ * Creates an empty region, nested in parent unless that is NULL. Memory
+ * is taken from mymalloc chunk_size bytes at a time (0 for the default
+ * of 64 KiB); requests bigger than a quarter of that get a chunk of
+ * their own. Returns NULL if mymalloc fails.
+ */
+Region *region_create(Region *parent, size_t chunk_size);
+
+
+/* Function: region_alloc
+ * ----------------------
+ * Allocates size bytes, aligned like mymalloc's blocks, that stay valid
+ * until the region is reset, destroyed or restored to an earlier
+ * savepoint. Returns NULL for size 0 or if mymalloc fails.
+ */
+void *region_alloc(Region *region, size_t size);
+
+
+/* Functions: region_save, region_restore
+ * --------------------------------------
+ * region_save returns a savepoint for the region's current state, and
+ * region_restore frees everything allocated (and every child region
+ * created) since. Savepoints nest like a stack: restoring one
+ * invalidates those saved after it.
+ */
+RegionMark region_save(Region *region);
+void region_restore(Region *region, RegionMark mark);
+
+
+/* Functions: region_reset, region_destroy
+ * ---------------------------------------
+ * region_reset frees everything in the region and destroys its
+ * children, but keeps one chunk for reuse, so a region reset after every
+ * request costs no mymalloc calls once warm. region_destroy also frees
+ * the region itself and unlinks it from its parent.
+ */
+void region_reset(Region *region);
+void region_destroy(Region *region);
+
+
+/* Function: region_size
+ * ---------------------
+ * Returns the bytes the region holds from mymalloc, children excluded.
+ */
+size_t region_size(Region *region);
+
+#endif
@@ -0,0 +1,106 @@
+/* File: region_bench.c
+ * --------------------
+ * Benchmark for regions against mymalloc/myfree. Each simulated request
+ * allocates a burst of objects of random size, writes to each, and then
+ * releases them all: one myfree per object, or one region_reset. A share
+ * of the requests also runs a nested sub-task in a child region or under
+ * a savepoint. Prints ns per object for both ways.
+ *
+ * usage: region_bench [-n objects_per_request] [-r requests] [-s max_size]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "allocator.h"
+#include "region.h"
+#include "segment.h"
+
+#define HEAP_SIZE (1L << 30)
+#define MAX_OBJECTS 4096
+
+static int objects = 200;
+static long requests = 50000;
+static size_t max_size = 512;
+static size_t sizes[MAX_OBJECTS];
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// serves the requests with mymalloc and myfree
+static void run_heap() {
+    void *blocks[MAX_OBJECTS];
+    
+    for (long r = 0; r < requests; r++) {
+        for (int i = 0; i < objects; i++) {
+            blocks[i] = mymalloc(sizes[i]);
+            *(char *)blocks[i] = 1; // touch the block like a real caller
+        }
+        for (int i = 0; i < objects; i++) {
+            myfree(blocks[i]);
+        }
+    }
+}
+
+// serves the requests from one region, reset after each; every fourth
+// request puts half its objects in a child region and every fourth
+// restores a savepoint halfway
+static void run_region() {
+    Region *region = region_create(NULL, 0);
+    
+    for (long r = 0; r < requests; r++) {
+        Region *target = region;
+        RegionMark mark = region_save(region);
+        for (int i = 0; i < objects; i++) {
+            if (i == objects / 2 && r % 4 == 1) {
+                target = region_create(region, 0);
+            } else if (i == objects / 2 && r % 4 == 2) {
+                region_restore(region, mark);
+            }
+            *(char *)region_alloc(target, sizes[i]) = 1;
+        }
+        region_reset(region);
+    }
+    region_destroy(region);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    
+    while ((opt = getopt(argc, argv, "n:r:s:")) != -1) {
+        switch (opt) {
+            case 'n': objects = atoi(optarg); break;
+            case 'r': requests = atol(optarg); break;
+            case 's': max_size = atol(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-n objects_per_request] [-r requests] [-s max_size]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (objects < 1 || objects > MAX_OBJECTS || requests < 1 || max_size < 1) {
+        fprintf(stderr, "bad arguments\n");
+        return 1;
+    }
+    if (!init_heap_segment(HEAP_SIZE) || !myinit(heap_segment_start(), heap_segment_size())) {
+        fprintf(stderr, "heap initialization failed\n");
+        return 1;
+    }
+    srand(1);
+    for (int i = 0; i < objects; i++) {
+        sizes[i] = rand() % max_size + 1;
+    }
+    
+    double start = now();
+    run_heap();
+    double heap_ns = (now() - start) * 1e9 / ((double)requests * objects);
+    start = now();
+    run_region();
+    double region_ns = (now() - start) * 1e9 / ((double)requests * objects);
+    printf("mymalloc/myfree %8.1f ns/object\n", heap_ns);
+    printf("region          %8.1f ns/object (%.2fx)\n", region_ns, heap_ns / region_ns);
+    return validate_heap() ? 0 : 1;
+}
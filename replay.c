@@ -0,0 +1,369 @@
+/* File: replay.c
+ * --------------
+ * Replays .script allocation traces against whichever allocator it is
+ * linked with (bump, implicit or explicit; see `make bench`) and reports
+ * throughput, per-operation latency and memory efficiency.
+ *
+ * A script has one request per line, blank lines and lines starting with
+ * '#' ignored:
+ *     a id size    mymalloc(size), remembered as id
+ *     r id size    myrealloc of id to size
+ *     f id         myfree of id
+ *
+ * Each script is replayed twice on a fresh heap: once straight through
+ * for throughput, then once timing each request on its own with the
+ * cycle counter (nanoseconds where there is none). Reported per script:
+ *   - throughput in requests per second of the first pass, and the page
+ *     faults it took (fewer with huge pages: replay_explicit_huge)
+ *   - latency percentiles for malloc, realloc, free and all requests
+ *   - peak utilization: the largest total payload live at once, over the
+ *     largest footprint (heap extent from the segment start to the end of
+ *     the highest block, plus blocks outside the segment)
+ *   - final fragmentation: the share of the footprint not holding live
+ *     payload after the last malloc or realloc (traces usually end by
+ *     freeing everything)
+ *
+ * usage: replay [-v | -V n] script...
+ *   -v  run validate_heap after every request and check that no block's
+ *       contents were disturbed (not timed)
+ *   -V  the same, but validate_heap only after every n-th request, for
+ *       long traces where a full check per request is too slow
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+#include "allocator.h"
+#include "segment.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define HEAP_SIZE (1L << 32) // only reserved: the allocator commits what it uses
+#define PAGE_SIZE 4096
+
+enum { OP_MALLOC, OP_REALLOC, OP_FREE, NUM_OPS };
+static const char *op_names[NUM_OPS] = { "malloc", "realloc", "free" };
+
+typedef struct {
+    int op;
+    size_t id;
+    size_t size;
+} Request;
+
+typedef struct {
+    Request *requests;
+    size_t nrequests;
+    size_t nids; // one more than the largest id
+} Script;
+
+typedef struct {
+    void *ptr;
+    size_t size;
+} Block;
+
+static bool verify;
+static size_t validate_every = 1; // requests between validate_heap calls
+
+// reads the current time in cycles, or nanoseconds if there is no
+// cycle counter
+static inline uint64_t now() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static double wall_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// minor and major page faults of the process so far
+static long page_faults() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_minflt + usage.ru_majflt;
+}
+
+// replays a script with nothing but the allocator calls and returns the
+// seconds it took, or a negative number if a request failed. Adds the
+// page faults taken to *faults
+static double time_script(Script *script, long *faults) {
+    void **ptrs = calloc(script->nids, sizeof(void *));
+    *faults -= page_faults();
+    double start = wall_seconds();
+    for (size_t i = 0; i < script->nrequests; i++) {
+        Request *req = &script->requests[i];
+        if (req->op == OP_MALLOC) {
+            ptrs[req->id] = mymalloc(req->size);
+        } else if (req->op == OP_REALLOC) {
+            ptrs[req->id] = myrealloc(ptrs[req->id], req->size);
+        } else {
+            myfree(ptrs[req->id]);
+            ptrs[req->id] = NULL;
+        }
+        if (req->op != OP_FREE && !ptrs[req->id] && req->size > 0) {
+            free(ptrs);
+            return -1;
+        }
+    }
+    double seconds = wall_seconds() - start;
+    *faults += page_faults();
+    free(ptrs);
+    return seconds;
+}
+
+// reads a script into memory. Returns false (having said why) if the
+// file can't be read or has a malformed line
+static bool read_script(const char *path, Script *script) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        perror(path);
+        return false;
+    }
+    size_t capacity = 1024;
+    script->requests = malloc(capacity * sizeof(Request));
+    script->nrequests = 0;
+    script->nids = 0;
+
+    char line[256];
+    for (int lineno = 1; fgets(line, sizeof(line), fp); lineno++) {
+        char type;
+        Request req = { 0 };
+        int fields = sscanf(line, " %c %zu %zu", &type, &req.id, &req.size);
+        if (fields <= 0 || type == '#') {
+            continue;
+        }
+        if (type == 'a' && fields == 3) {
+            req.op = OP_MALLOC;
+        } else if (type == 'r' && fields == 3) {
+            req.op = OP_REALLOC;
+        } else if (type == 'f' && fields >= 2) {
+            req.op = OP_FREE;
+        } else {
+            fprintf(stderr, "%s:%d: bad request: %s", path, lineno, line);
+            fclose(fp);
+            free(script->requests);
+            return false;
+        }
+        if (script->nrequests == capacity) {
+            capacity *= 2;
+            script->requests = realloc(script->requests, capacity * sizeof(Request));
+        }
+        script->requests[script->nrequests++] = req;
+        if (req.id >= script->nids) {
+            script->nids = req.id + 1;
+        }
+    }
+    fclose(fp);
+    return true;
+}
+
+// fills a block with a pattern derived from its id, or checks it is
+// still there
+static void fill_block(Block *b, size_t id) {
+    memset(b->ptr, (int)(id & 0xff), b->size);
+}
+
+static bool check_block(Block *b, size_t id) {
+    unsigned char *p = b->ptr;
+    for (size_t i = 0; i < b->size; i++) {
+        if (p[i] != (unsigned char)(id & 0xff)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// prints percentiles of n latencies (sorted in place)
+static void print_latencies(const char *name, uint64_t *lat, size_t n) {
+    if (n == 0) {
+        return;
+    }
+    qsort(lat, n, sizeof(uint64_t), compare_u64);
+    printf("  %-8s %9zu %8lu %8lu %8lu %8lu %10lu\n", name, n,
+           (unsigned long)lat[n / 2], (unsigned long)lat[n * 90 / 100],
+           (unsigned long)lat[n * 99 / 100], (unsigned long)lat[n * 999 / 1000],
+           (unsigned long)lat[n - 1]);
+}
+
+// replays a script on a fresh heap and prints its report. Returns false
+// if the allocator failed a request or (with -v) corrupted the heap
+static bool replay(const char *path, Script *script) {
+    char *heap_start = init_heap_segment(HEAP_SIZE);
+    if (!heap_start || !myinit(heap_start, HEAP_SIZE)) {
+        fprintf(stderr, "%s: heap initialization failed\n", path);
+        return false;
+    }
+    long faults = 0;
+    double seconds = time_script(script, &faults);
+    heap_start = init_heap_segment(HEAP_SIZE);
+    if (!heap_start || !myinit(heap_start, HEAP_SIZE)) {
+        fprintf(stderr, "%s: heap initialization failed\n", path);
+        return false;
+    }
+    Block *blocks = calloc(script->nids, sizeof(Block));
+    uint64_t *lat[NUM_OPS];
+    size_t nlat[NUM_OPS] = { 0 };
+    for (int op = 0; op < NUM_OPS; op++) {
+        lat[op] = malloc((script->nrequests + 1) * sizeof(uint64_t));
+    }
+    size_t payload = 0, peak_payload = 0; // bytes requested and live
+    size_t extent = 0; // end of the highest block in the segment
+    size_t outside = 0; // bytes in blocks outside the segment
+    size_t footprint = 0, peak_footprint = 0;
+    size_t final_payload = 0, final_footprint = 0; // after the last malloc/realloc
+
+    bool ok = true;
+    for (size_t i = 0; i < script->nrequests; i++) {
+        Request *req = &script->requests[i];
+        Block *b = &blocks[req->id];
+        if (req->op != OP_MALLOC && verify && b->ptr && !check_block(b, req->id)) {
+            fprintf(stderr, "%s: request %zu: block %zu was overwritten\n", path, i, req->id);
+            ok = false;
+            break;
+        }
+        void *old_ptr = b->ptr;
+        size_t old_size = b->size;
+        void *ptr = NULL;
+
+        uint64_t start = now();
+        if (req->op == OP_MALLOC) {
+            ptr = mymalloc(req->size);
+        } else if (req->op == OP_REALLOC) {
+            ptr = myrealloc(old_ptr, req->size);
+        } else {
+            myfree(old_ptr);
+        }
+        uint64_t cycles = now() - start;
+        lat[req->op][nlat[req->op]++] = cycles;
+
+        if (req->op != OP_FREE && ptr == NULL && req->size > 0) {
+            fprintf(stderr, "%s: request %zu: %s of %zu bytes failed\n",
+                    path, i, op_names[req->op], req->size);
+            ok = false;
+            break;
+        }
+        if (ptr != NULL && (uintptr_t)ptr % ALIGNMENT != 0) {
+            fprintf(stderr, "%s: request %zu: %p is misaligned\n", path, i, ptr);
+            ok = false;
+            break;
+        }
+        if (old_ptr && ((char *)old_ptr < heap_start || (char *)old_ptr >= heap_start + HEAP_SIZE)) {
+            outside -= (old_size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1UL);
+        }
+        payload -= old_size;
+        b->ptr = (req->op == OP_FREE) ? NULL : ptr;
+        b->size = (req->op == OP_FREE) ? 0 : req->size;
+        payload += b->size;
+        if (b->ptr) {
+            if ((char *)ptr >= heap_start && (char *)ptr < heap_start + HEAP_SIZE) {
+                size_t end = (char *)ptr + b->size - heap_start;
+                extent = (end > extent) ? end : extent;
+            } else { // mapped on its own: count whole pages
+                outside += (b->size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1UL);
+            }
+        }
+        footprint = extent + outside;
+        peak_payload = (payload > peak_payload) ? payload : peak_payload;
+        peak_footprint = (footprint > peak_footprint) ? footprint : peak_footprint;
+        if (req->op != OP_FREE) {
+            final_payload = payload;
+            final_footprint = footprint;
+        }
+
+        if (verify) {
+            if (b->ptr) {
+                fill_block(b, req->id);
+            }
+            if ((i + 1) % validate_every == 0 && !validate_heap()) {
+                fprintf(stderr, "%s: request %zu: validate_heap failed\n", path, i);
+                ok = false;
+                break;
+            }
+        }
+    }
+
+    if (!ok) {
+        for (int op = 0; op < NUM_OPS; op++) {
+            free(lat[op]);
+        }
+        free(blocks);
+        return false;
+    }
+    uint64_t *all = malloc((script->nrequests + 1) * sizeof(uint64_t));
+    size_t nall = 0;
+    for (int op = 0; op < NUM_OPS; op++) {
+        memcpy(all + nall, lat[op], nlat[op] * sizeof(uint64_t));
+        nall += nlat[op];
+    }
+    printf("%s\n", path);
+    printf("  throughput     %.2f Mops/s (%zu requests in %.3f ms, %ld page faults)\n",
+           seconds > 0 ? nall / seconds / 1e6 : 0.0, nall, seconds * 1e3, faults);
+    printf("  utilization    %.1f%% peak (%zu payload bytes, %zu footprint)\n",
+           peak_footprint ? 100.0 * peak_payload / peak_footprint : 100.0,
+           peak_payload, peak_footprint);
+    printf("  fragmentation  %.1f%% at end (%zu payload bytes, %zu footprint)\n",
+           final_footprint ? 100.0 * (final_footprint - final_payload) / final_footprint : 0.0,
+           final_payload, final_footprint);
+#if defined(__x86_64__) || defined(__i386__)
+    printf("  latency (cycles)  count      p50      p90      p99    p99.9        max\n");
+#else
+    printf("  latency (ns)      count      p50      p90      p99    p99.9        max\n");
+#endif
+    for (int op = 0; op < NUM_OPS; op++) {
+        print_latencies(op_names[op], lat[op], nlat[op]);
+    }
+    print_latencies("all", all, nall);
+
+    for (int op = 0; op < NUM_OPS; op++) {
+        free(lat[op]);
+    }
+    free(all);
+    free(blocks);
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "vV:")) != -1) {
+        if (opt == 'v') {
+            verify = true;
+        } else if (opt == 'V' && atol(optarg) > 0) {
+            verify = true;
+            validate_every = atol(optarg);
+        } else {
+            fprintf(stderr, "usage: %s [-v | -V n] script...\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind == argc) {
+        fprintf(stderr, "usage: %s [-v | -V n] script...\n", argv[0]);
+        return 1;
+    }
+
+    int failures = 0;
+    for (int i = optind; i < argc; i++) {
+        Script script;
+        if (!read_script(argv[i], &script) || !replay(argv[i], &script)) {
+            failures++;
+            continue;
+        }
+        free(script.requests);
+    }
+    return failures ? 1 : 0;
+}
@@ -3,20 +3,50 @@
  * Handles low-level storage underneath the heap allocator. It reserves
  * the large memory segment using the OS-level mmap facility.
  *
+ * The segment is only reserved address space: nothing in it can be
+ * touched until the allocator commits it with heap_segment_commit, so
+ * asking for a huge segment costs neither memory nor commit charge.
+ * Pages the allocator no longer needs are handed back with
+ * heap_segment_release and stay committed.
+ *
+ * Built with -DSEGMENT_HUGE_PAGES, the segment starts on a 2 MiB boundary
+ * and asks for transparent huge pages (madvise MADV_HUGEPAGE), so a big
+ * heap needs 512 times fewer TLB entries; it is committed 2 MiB at a time
+ * so that whole huge pages become writable together. Releasing part of a
+ * huge page splits it, and what is faulted back in there comes in 4 KiB
+ * pages until the kernel collapses it again. -DSEGMENT_HUGETLB first tries
+ * to map the segment from the preallocated huge page pool (MAP_HUGETLB,
+ * see /proc/sys/vm/nr_hugepages), which guarantees huge pages but only
+ * releases whole ones, so released memory is no longer known to read as
+ * zeros. Either falls back to what the kernel can do: transparent huge
+ * pages if the pool can't hold the segment, and plain pages if those are
+ * off.
  */
 
 #include "segment.h"
 #include <assert.h>
+#include <stdint.h>
 #include <sys/mman.h>
 
 /* Place segment at fixed address, as default addresses are quite high
  * and easily mistaken for stack addresses.
  */
 #define HEAP_START_HINT (void *)0x107000000L
+#define PAGE_SIZE 4096
+#define HUGE_PAGE_SIZE (2L << 20)
+
+#if defined(SEGMENT_HUGETLB) && !defined(SEGMENT_HUGE_PAGES)
+#define SEGMENT_HUGE_PAGES // the fallback
+#endif
+#ifndef MAP_HUGE_2MB
+#define MAP_HUGE_2MB (21 << 26) // log2 of the page size, at MAP_HUGE_SHIFT
+#endif
 
 // Static means these variables are only visible within this file
 static void *segment_start = NULL;
 static size_t segment_size = 0;
+static size_t commit_unit = PAGE_SIZE; // pages are committed in whole units
+static size_t release_unit = PAGE_SIZE; // and released in whole units
 
 void *heap_segment_start() {
     return segment_start;
@@ -29,14 +59,101 @@ size_t heap_segment_size() {
 void *init_heap_segment(size_t total_size) {
     // Discard any previous segment via munmap
     if (segment_start != NULL) {
-        if (munmap(segment_start, total_size) == -1) return NULL;
+        if (munmap(segment_start, segment_size) == -1) return NULL;
         segment_start = NULL;
         segment_size = 0;
     }
     
+    commit_unit = release_unit = PAGE_SIZE;
+    
+#ifdef SEGMENT_HUGETLB
+    // the pool's pages are set aside now, so the mapping fails rather
+    // than a later fault if there are too few of them
+    if (total_size % HUGE_PAGE_SIZE == 0) {
+        void *start = mmap(HEAP_START_HINT, total_size, PROT_NONE,
+                           MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB|MAP_HUGE_2MB, -1, 0);
+        if (start != MAP_FAILED) {
+            segment_start = start;
+            segment_size = total_size;
+            commit_unit = release_unit = HUGE_PAGE_SIZE;
+            return segment_start;
+        }
+    }
+#endif
+#ifdef SEGMENT_HUGE_PAGES
+    // reserve a huge page more than needed and trim it to a boundary
+    char *start = mmap(HEAP_START_HINT, total_size + HUGE_PAGE_SIZE, PROT_NONE,
+                       MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+    assert(start != MAP_FAILED);
+    char *aligned = (char *)(((uintptr_t)start + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+    if (aligned > start) {
+        munmap(start, aligned - start);
+    }
+    munmap(aligned + ((total_size + PAGE_SIZE - 1) & ~(size_t)(PAGE_SIZE - 1)), start + HUGE_PAGE_SIZE - aligned);
+    if (madvise(aligned, total_size, MADV_HUGEPAGE) == 0) {
+        commit_unit = HUGE_PAGE_SIZE;
+    }
+    segment_start = aligned;
+#else
     // Re-initialize by reserving entire segment with mmap
-    segment_start = mmap(HEAP_START_HINT, total_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    segment_start = mmap(HEAP_START_HINT, total_size, PROT_NONE,
+                         MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
     assert(segment_start != MAP_FAILED);
+#endif
     segment_size = total_size;
     return segment_start;
 }
+
+// clips [*start, *end) to the segment, rounding outward to whole units
+// of unit bytes if outward is set and inward otherwise. Returns false if
+// nothing is left
+static bool clip_to_segment(uintptr_t *start, uintptr_t *end, size_t unit, bool outward) {
+    uintptr_t seg_start = (uintptr_t)segment_start;
+    uintptr_t seg_end = seg_start + segment_size;
+    
+    if (outward) {
+        *start &= ~(uintptr_t)(unit - 1);
+        *end = (*end + unit - 1) & ~(uintptr_t)(unit - 1);
+    } else {
+        *start = (*start + unit - 1) & ~(uintptr_t)(unit - 1);
+        *end &= ~(uintptr_t)(unit - 1);
+    }
+    if (*start < seg_start) *start = seg_start;
+    if (*end > seg_end) *end = seg_end;
+    return *start < *end;
+}
+
+bool heap_segment_commit(void *addr, size_t len) {
+    uintptr_t start = (uintptr_t)addr;
+    uintptr_t end = start + len;
+    if (!clip_to_segment(&start, &end, commit_unit, true)) {
+        return true; // not segment memory: nothing to commit
+    }
+    return mprotect((void *)start, end - start, PROT_READ|PROT_WRITE) == 0;
+}
+
+void heap_segment_release(void *addr, size_t len) {
+    uintptr_t start = (uintptr_t)addr;
+    uintptr_t end = start + len;
+    if (!clip_to_segment(&start, &end, release_unit, false)) {
+        return;
+    }
+#if defined(SEGMENT_MADV_FREE) && defined(MADV_FREE)
+    madvise((void *)start, end - start, MADV_FREE); // reclaimed lazily, contents undefined
+#else
+    madvise((void *)start, end - start, MADV_DONTNEED); // pages read back as zeros
+#endif
+}
+
+bool heap_segment_zeroes(void *addr, size_t len) {
+    uintptr_t start = (uintptr_t)addr;
+    uintptr_t seg_start = (uintptr_t)segment_start;
+    if (segment_start == NULL || start < seg_start || start + len > seg_start + segment_size) {
+        return false;
+    }
+#if defined(SEGMENT_MADV_FREE) && defined(MADV_FREE)
+    return false;
+#else
+    return release_unit == PAGE_SIZE; // all of a released range is handed back
+#endif
+}
@@ -6,6 +6,7 @@
 
 #ifndef _SEGMENT_H_
 #define _SEGMENT_H_
+#include <stdbool.h> // for bool
 #include <stddef.h> // for size_t
 
 
@@ -16,7 +17,10 @@
  * is called again, it discards the current heap segment and re-configures. 
  * The function returns the base address of the heap segment if successful 
  * or NULL if the initialization failed. The base address of the heap segment 
- * is always aligned to start on a page boundary (page size is 4096 bytes).
+ * is always aligned to start on a page boundary (page size is 4096 bytes),
+ * and on a 2 MiB one when segment.c is built for huge pages
+ * (-DSEGMENT_HUGE_PAGES or -DSEGMENT_HUGETLB).
+ * The segment is reserved but not committed: see heap_segment_commit.
  */
 void *init_heap_segment(size_t total_size);
 
@@ -32,4 +36,34 @@ void *heap_segment_start();
 size_t heap_segment_size();
 
 
+/* Functions: heap_segment_commit, heap_segment_release
+ * ----------------------------------------------------
+ * heap_segment_commit makes the pages overlapping [addr, addr + len)
+ * readable and writable; the allocator must commit memory before it
+ * first touches it. Committing is idempotent and returns false if the OS
+ * refuses; with huge pages it commits whole ones. heap_segment_release
+ * gives the whole pages inside the range (whole huge pages, if the
+ * segment came from the MAP_HUGETLB pool) back to the OS; they stay
+ * committed and read back as zeros (unless segment.c is built with
+ * -DSEGMENT_MADV_FREE, where their contents are undefined until
+ * rewritten). Both ignore any part of the range outside
+ * the segment, so a heap placed in other memory needs no special case.
+ */
+bool heap_segment_commit(void *addr, size_t len);
+void heap_segment_release(void *addr, size_t len);
+
+
+/* Function: heap_segment_zeroes
+ * -----------------------------
+ * Returns true if [addr, addr + len) lies inside the segment and pages
+ * there read back as zeros after heap_segment_release, as they do when
+ * first committed: false for memory outside the segment, when segment.c
+ * is built with -DSEGMENT_MADV_FREE, or when the segment came from the
+ * MAP_HUGETLB pool (a release leaves partial huge pages as they were).
+ * An allocator can then hand out such pages as zeroed memory without
+ * clearing them.
+ */
+bool heap_segment_zeroes(void *addr, size_t len);
+
+
 #endif
@@ -0,0 +1,175 @@
+/* File: shim.c
+ * ------------
+ * Drop-in replacement for the C library's allocation functions, built
+ * with the thread-safe explicit allocator into libmyalloc.so (`make
+ * libmyalloc.so`) so unmodified programs can run on it:
+ *
+ *     LD_PRELOAD=./libmyalloc.so some_program
+ *
+ * The first call reserves a SHIM_HEAP_SIZE segment and runs myinit; the
+ * segment is only reserved, so its size costs nothing until used. An
+ * allocation made while that is under way (by the C library, on the same
+ * thread) fails rather than recursing. Everything else maps onto the
+ * my* functions, adding what the C library promises on top: malloc(0)
+ * returns a unique pointer, failures set errno, calloc checks for
+ * overflow, and a request too big for the heap (MAX_REQUEST_SIZE) still
+ * succeeds as a mapped block if the OS has room for it.
+ *
+ * The library is built with hidden visibility so that only the functions
+ * below are exported: the allocator's internal names cannot be interposed
+ * by the program's own symbols. Its thread-locals use the initial-exec
+ * TLS model, as a malloc can't afford a __tls_get_addr call that may
+ * itself allocate.
+ *
+ * Built with -DPROFILE_RATE (libmyalloc_profile.so), the library writes
+ * the heap profile as the program exits to $MYALLOC_PROFILE.<pid>.heap,
+ * if that variable is set, for `pprof --text program file`.
+ */
+
+#include "allocator.h"
+#include "segment.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#if PROFILE_RATE > 0
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#endif
+
+#ifndef SHIM_HEAP_SIZE
+#define SHIM_HEAP_SIZE (16L << 30) // reserved, committed as the heap grows
+#endif
+#define PAGE_SIZE 4096
+
+#define EXPORT __attribute__((visibility("default")))
+
+static bool ready;
+static pthread_mutex_t init_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread bool initializing;
+
+// initializes the heap on first use. Returns false if that failed, or
+// if called back from within the initialization
+static bool ensure_heap() {
+    if (__atomic_load_n(&ready, __ATOMIC_ACQUIRE)) {
+        return true;
+    }
+    if (initializing) {
+        return false;
+    }
+    initializing = true;
+    pthread_mutex_lock(&init_lock);
+    if (!ready) {
+        void *start = init_heap_segment(SHIM_HEAP_SIZE);
+        if (start && myinit(start, SHIM_HEAP_SIZE)) {
+            __atomic_store_n(&ready, true, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&init_lock);
+    initializing = false;
+    return ready;
+}
+
+// common tail of the allocating functions: sets errno on failure
+static void *checked(void *block) {
+    if (block == NULL) {
+        errno = ENOMEM;
+    }
+    return block;
+}
+
+EXPORT void *malloc(size_t size) {
+    if (!ensure_heap()) {
+        return checked(NULL);
+    }
+    return checked(mymalloc(size ? size : 1));
+}
+
+EXPORT void free(void *ptr) {
+    if (ptr) { // nothing can be allocated before the heap is ready
+        myfree(ptr);
+    }
+}
+
+// mycalloc skips clearing memory that is still zero from the OS
+EXPORT void *calloc(size_t count, size_t size) {
+    size_t total;
+    if (__builtin_mul_overflow(count, size, &total) || !ensure_heap()) {
+        return checked(NULL);
+    }
+    return checked(mycalloc(1, total ? total : 1));
+}
+
+// realloc to size 0 frees the block and returns NULL, as glibc does
+EXPORT void *realloc(void *ptr, size_t size) {
+    if (ptr == NULL) {
+        return malloc(size);
+    }
+    if (size == 0) {
+        myfree(ptr);
+        return NULL;
+    }
+    return checked(myrealloc(ptr, size));
+}
+
+EXPORT int posix_memalign(void **result, size_t align, size_t size) {
+    if (align == 0 || (align & (align - 1)) != 0 || align % sizeof(void *) != 0) {
+        return EINVAL;
+    }
+    if (!ensure_heap()) {
+        return ENOMEM;
+    }
+    void *block = mymemalign(align, size ? size : 1);
+    if (block == NULL) {
+        return ENOMEM;
+    }
+    *result = block;
+    return 0;
+}
+
+EXPORT void *aligned_alloc(size_t align, size_t size) {
+    if (align == 0 || (align & (align - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (!ensure_heap()) {
+        return checked(NULL);
+    }
+    return checked(mymemalign(align, size ? size : 1));
+}
+
+// the obsolete aligned allocators, so no block from the C library's own
+// malloc is ever passed to free
+EXPORT void *memalign(size_t align, size_t size) {
+    return aligned_alloc(align, size);
+}
+
+EXPORT void *valloc(size_t size) {
+    return aligned_alloc(PAGE_SIZE, size);
+}
+
+EXPORT void *pvalloc(size_t size) {
+    return aligned_alloc(PAGE_SIZE, (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1UL));
+}
+
+EXPORT size_t malloc_usable_size(void *ptr) {
+    return myusable_size(ptr);
+}
+
+#if PROFILE_RATE > 0
+// writes the profile of whatever is still live at exit, and of all the
+// program allocated before
+__attribute__((destructor)) static void dump_profile() {
+    const char *prefix = getenv("MYALLOC_PROFILE");
+    if (prefix == NULL || !ready) {
+        return;
+    }
+    char path[4096];
+    snprintf(path, sizeof(path), "%s.%d.heap", prefix, (int)getpid());
+    FILE *fp = fopen(path, "w");
+    if (fp) {
+        myheap_dump_profile(fp, true);
+        fclose(fp);
+    }
+}
+#endif